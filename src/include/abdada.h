@@ -0,0 +1,73 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef ABDADA_H
+#define ABDADA_H
+
+#include <stdatomic.h>
+#include "hashkey.h"
+#include "types.h"
+
+// ABDADA table of the nodes currently being searched by a worker. Each slot
+// holds the key of a node, with the search depth stored in the low byte, or
+// zero when empty. Slots are claimed with a CAS and never overwritten, so a
+// collision only means that a busy node won't be marked.
+
+enum
+{
+    AbdadaTableSize = 1 << 14,
+
+    // Minimal depth for marking nodes and deferring moves.
+    AbdadaMinDepth = 5
+};
+
+extern _Atomic uint64_t AbdadaTable[AbdadaTableSize];
+
+INLINED uint64_t abdada_tag(hashkey_t key, int depth)
+{
+    return ((key & ~(uint64_t)0xFF) | (uint8_t)depth);
+}
+
+INLINED _Atomic uint64_t *abdada_slot(hashkey_t key)
+{
+    return (&AbdadaTable[key % AbdadaTableSize]);
+}
+
+// Returns whether the node is currently searched by another worker at the
+// given depth.
+INLINED bool abdada_is_busy(hashkey_t key, int depth)
+{
+    return (atomic_load_explicit(abdada_slot(key), memory_order_relaxed) == abdada_tag(key, depth));
+}
+
+// Marks the node as being searched. Returns whether the slot was claimed, in
+// which case abdada_leave() must be called once the search of the node ends.
+INLINED bool abdada_enter(hashkey_t key, int depth)
+{
+    uint64_t empty = 0;
+
+    return (atomic_compare_exchange_strong_explicit(abdada_slot(key), &empty, abdada_tag(key, depth),
+        memory_order_relaxed, memory_order_relaxed));
+}
+
+INLINED void abdada_leave(hashkey_t key)
+{
+    atomic_store_explicit(abdada_slot(key), 0, memory_order_relaxed);
+}
+
+#endif // ABDADA_H
@@ -71,6 +71,10 @@ bitboard_t attackers_list(const board_t *board, square_t s, bitboard_t occupied)
 void do_castling(board_t *board, color_t us, square_t kingFrom, square_t *kingTo,
     square_t *rookFrom, square_t *rookTo);
 void do_move_gc(board_t *board, move_t move, boardstack_t *stack, bool givesCheck);
+
+// Returns the hash key of the position reached after playing the given move,
+// without actually playing it.
+hashkey_t board_key_after(const board_t *board, move_t move);
 void do_null_move(board_t *board, boardstack_t *stack);
 const char *board_fen(const board_t *board);
 bool game_is_drawn(const board_t *board, int ply);
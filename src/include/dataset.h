@@ -1,19 +1,77 @@
 #ifndef DATASET_H
 #define DATASET_H
 
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "lz.h"
 #include "weight.h"
 
+// Dataset file structure (all integers are stored in little-endian order):
+// File header: magic "VDSF", format version (u32), reserved (u32 x 2)
+// Sequence of blocks, each one made of:
+//  - Block header: entry count (u32), payload size (u32), payload CRC-32 (u32),
+//    block flags (u32)
+//  - Payload: for each entry, input size (u32), output size (u32), input data
+//    and output data
+// When block flags are set, the payload is stored in coded form instead:
+//  - Decoded payload size (u32), size of the stream once LZ-decompressed (u32)
+//  - The coded stream. Delta coding is applied first, then LZ compression.
+// Delta-coded streams store each entry as its sizes (as varints), followed by
+// runs of unchanged byte count (varint), changed byte count (varint) and the
+// changed bytes, compared to the previous entry of the block if it has the same
+// sizes, or to zero bytes otherwise.
+// Block flags only exist since version 2. Version 1 files are still read, and
+// blocks appended to them are stored uncompressed, so that they stay readable
+// by older versions.
+// Entry data is stored as given by the caller. Raw weight_t entries (used when
+// no decoder is set) keep the byte order of the system that wrote them.
+
+#define DATASET_MAGIC "VDSF"
+
+enum
+{
+    DatasetVersion = 2,
+    DatasetHeaderSize = 16,
+    DatasetBlockHeaderSize = 16,
+    DatasetBlockSize = 1 << 20,
+    DatasetMaxBlockSize = 1 << 30
+};
+
+// Block flags.
+enum
+{
+    DatasetDeltaCoded = 1 << 0,
+    DatasetLzCompressed = 1 << 1,
+    DatasetKnownFlags = DatasetDeltaCoded | DatasetLzCompressed
+};
+
+// Computes the standard CRC-32 of the given buffer.
+uint32_t dataset_crc32(const void *data, size_t size);
+
+// Stored entry. The input and output data are kept back-to-back in the dataset
+// payload arena, starting at the given offset.
 typedef struct _DatasetEntry
 {
-    void *inData;
-    void *outData;
+    size_t offset;
+    uint32_t inSize;
+    uint32_t outSize;
+}
+DatasetEntry;
+
+// Read-only view of an entry, as handed to the decoding function. Note that the
+// data is byte-packed, so decoders should not assume any alignment for it.
+typedef struct _DatasetView
+{
+    const void *inData;
+    const void *outData;
     size_t inSize;
     size_t outSize;
 }
-DatasetEntry;
+DatasetView;
 
-typedef void (*decoder_t)(const DatasetEntry *, weight_t *, weight_t *);
+typedef void (*decoder_t)(const DatasetView *, weight_t *, weight_t *);
 
 typedef struct _Dataset
 {
@@ -22,6 +80,9 @@ typedef struct _Dataset
     DatasetEntry *entries;
     size_t entryCount;
     size_t entryMaxCount;
+    unsigned char *payload;
+    size_t payloadSize;
+    size_t payloadMaxSize;
     decoder_t decode;
 }
 Dataset;
@@ -32,20 +93,167 @@ void dataset_init(Dataset *d, size_t inputSize, size_t outputSize);
 // Sets the decoding function for all entries.
 void dataset_set_data_decoder(Dataset *d, decoder_t decode);
 
+// Reserves memory for at least entryCount entries and payloadSize bytes of
+// entry data, to avoid regrowing the buffers when the final size of the
+// dataset is known in advance. Returns zero if successful, non-zero integer
+// otherwise.
+int dataset_reserve(Dataset *d, size_t entryCount, size_t payloadSize);
+
 // Adds a new entry to the dataset. If no decoding function is set, inSize
 // and outSize will be ignored. Returns zero if the entry has been
 // successfully added, non-zero integer otherwise.
 int dataset_add_entry(Dataset *d, const void *inData, const void *outData, size_t inSize, size_t outSize);
 
-// Writes the current entries from the dataset to the given file, and empties
+// Returns a view of the entry at the given index. The view is invalidated by
+// any subsequent call adding entries to the dataset.
+static inline DatasetView dataset_entry_view(const Dataset *d, size_t index)
+{
+    const DatasetEntry *entry = d->entries + index;
+    const unsigned char *data = d->payload + entry->offset;
+
+    return ((DatasetView){data, data + entry->inSize, entry->inSize, entry->outSize});
+}
+
+// Appends the current entries from the dataset to the given file, and empties
 // the entry buffer. Returns zero if successful, non-zero integer otherwise.
-// (For error returns less than or equal to -2, the errors are not recoverable
-// for now, this behavior might be fixed in the future.)
-// The binary format of the file might not be suitable for transfer between
-// different systems.
+// (For error returns less than or equal to -2, the file might have been left
+// with a partially written block, which will be reported as corrupted when
+// read back.)
 int dataset_push_entries(Dataset *d, const char *filename);
 
+// Removes all entries from the dataset, but keeps the allocated memory around
+// for further use.
+void dataset_clear(Dataset *d);
+
 // Frees all memory allocated by the dataset and resets it to an unused state.
 void dataset_destroy(Dataset *d);
 
+// Buffered writer for dataset files. Entries are packed into blocks of about
+// DatasetBlockSize bytes, which are flushed to disk as soon as they are full,
+// so that the whole set never has to be held in memory.
+typedef struct _DatasetWriter
+{
+    FILE *f;
+    unsigned char *block;
+    size_t blockSize;
+    size_t blockMaxSize;
+    uint32_t blockEntries;
+    uint32_t flags;
+    uint32_t versionFlags;
+    unsigned char *scratch;
+    unsigned char *packed;
+    size_t scratchMaxSize;
+    size_t packedMaxSize;
+    LzState *lz;
+}
+DatasetWriter;
+
+// Opens the given file for writing. New entries are appended at the end of
+// the file if it already exists. Blocks are written delta-coded and
+// LZ-compressed by default. Returns zero if successful, non-zero integer
+// otherwise.
+int dataset_writer_open(DatasetWriter *w, const char *filename);
+
+// Same as dataset_writer_open(), but truncates the file first if it already
+// exists, so that it only holds the entries written through this writer.
+int dataset_writer_create(DatasetWriter *w, const char *filename);
+
+// Selects the coding applied to the next blocks written (a combination of
+// block flags, zero storing them uncompressed). Blocks which do not shrink
+// with the requested coding, or which are appended to a version 1 file, are
+// stored uncompressed.
+void dataset_writer_set_flags(DatasetWriter *w, uint32_t flags);
+
+// Appends a new entry to the file. Returns zero if successful, non-zero
+// integer otherwise.
+int dataset_writer_append(DatasetWriter *w, const void *inData, const void *outData, size_t inSize, size_t outSize);
+
+// Writes the pending block to the file. Returns zero if successful, non-zero
+// integer otherwise.
+int dataset_writer_flush(DatasetWriter *w);
+
+// Flushes the pending block, closes the file and frees all memory allocated
+// by the writer. Returns zero if successful, non-zero integer otherwise.
+int dataset_writer_close(DatasetWriter *w);
+
+// Returns whether both names refer to the same existing file, in which case
+// creating a writer on one would destroy the entries read from the other.
+int dataset_same_file(const char *filename1, const char *filename2);
+
+// Block slot of a dataset reader, holding the stored and decoded forms of a
+// block. The ready flag is set by the loader once the block is decoded.
+typedef struct _DatasetBlock
+{
+    unsigned char *stored;
+    unsigned char *scratch;
+    unsigned char *data;
+    size_t storedMaxSize;
+    size_t scratchMaxSize;
+    size_t dataMaxSize;
+    size_t storedSize;
+    const unsigned char *payload;
+    size_t payloadSize;
+    uint32_t entryCount;
+    uint32_t crc;
+    uint32_t flags;
+    int status;
+    int ready;
+}
+DatasetBlock;
+
+// Sequential reader for dataset files. All block checksums are verified before
+// any of their entries are handed to the caller. A pool of loader threads (one
+// per reader thread) reads the blocks in file order, and decodes them in
+// parallel ahead of the caller into a ring of block slots. The loaders are
+// started on the first read, and stopped when the reader is rewound or closed.
+typedef struct _DatasetReader
+{
+    FILE *f;
+    uint32_t versionFlags;
+    DatasetBlock *blocks;
+    int slotCount;
+    int threads;
+    pthread_t *loaders;
+    int loaderCount;
+    pthread_mutex_t mutex;
+    pthread_cond_t slotFreed;
+    pthread_cond_t blockReady;
+
+    // Sequence numbers of the next block to read from the file, and of the
+    // block being handed to the caller. Block n lives in slot n % slotCount.
+    uint64_t nextLoad;
+    uint64_t nextConsume;
+    int holdingBlock;
+    int endOfFile;
+    int exit;
+
+    size_t cursor;
+    uint32_t remaining;
+}
+DatasetReader;
+
+// Opens the given file for reading and checks its header. Returns zero if
+// successful, non-zero integer otherwise.
+int dataset_reader_open(DatasetReader *r, const char *filename);
+
+// Sets the number of loader threads used for reading and decoding blocks, and
+// rewinds the reader. Returns zero if successful, non-zero integer otherwise.
+int dataset_reader_set_threads(DatasetReader *r, int threads);
+
+// Reads the next entry from the file. The view stays valid until the next
+// call to a reader function. Returns 1 if an entry was read, 0 at the end of
+// the file, and a negative integer if the file is corrupted.
+int dataset_reader_next(DatasetReader *r, DatasetView *view);
+
+// Counts the entries of the file by walking the block headers, then rewinds
+// the reader. Returns zero if successful, non-zero integer otherwise.
+int dataset_reader_count(DatasetReader *r, uint64_t *entryCount);
+
+// Moves the reader back to the first entry of the file. Returns zero if
+// successful, non-zero integer otherwise.
+int dataset_reader_rewind(DatasetReader *r);
+
+// Closes the file and frees all memory allocated by the reader.
+void dataset_reader_close(DatasetReader *r);
+
 #endif
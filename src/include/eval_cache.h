@@ -0,0 +1,68 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EVAL_CACHE_H
+#define EVAL_CACHE_H
+
+#include "hashkey.h"
+#include "types.h"
+
+// Per-worker cache of static evaluations. Each entry fits in 64 bits: the high
+// 48 bits of the key are used for verification, and the low 16 bits hold the
+// eval. The entry index comes from the low bits of the key.
+typedef struct eval_cache_s
+{
+    uint64_t *table;
+    size_t mask;
+    uint64_t probes;
+    uint64_t hits;
+}
+eval_cache_t;
+
+INLINED uint64_t *eval_cache_entry(eval_cache_t *cache, hashkey_t key)
+{
+    return (&cache->table[key & cache->mask]);
+}
+
+INLINED bool eval_cache_probe(eval_cache_t *cache, hashkey_t key, score_t *eval)
+{
+    uint64_t entry = *eval_cache_entry(cache, key);
+
+    ++cache->probes;
+
+    if ((entry ^ key) >> 16)
+        return (false);
+
+    ++cache->hits;
+    *eval = (int16_t)(uint16_t)entry;
+    return (true);
+}
+
+INLINED void eval_cache_store(eval_cache_t *cache, hashkey_t key, score_t eval)
+{
+    *eval_cache_entry(cache, key) = (key & ~(uint64_t)0xFFFF) | (uint16_t)eval;
+}
+
+// Resizes the cache to the largest power of two number of entries fitting in
+// the given size, a zero size disabling the cache.
+void eval_cache_resize(eval_cache_t *cache, size_t mbsize);
+
+// Empties the cache and resets its statistics.
+void eval_cache_clear(eval_cache_t *cache);
+
+#endif // EVAL_CACHE_H
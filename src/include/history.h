@@ -76,4 +76,12 @@ INLINED score_t get_cap_history_score(const capture_history_t hist, piece_t pc,
     return (hist[pc][to][piece_type(captured)] / HistoryScale);
 }
 
+// Halves all entries of a history table, which is seen as a flat array of
+// the given number of entries.
+INLINED void age_history(int16_t *table, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+        table[i] /= 2;
+}
+
 #endif // HISTORY_H
@@ -0,0 +1,55 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef LARGE_PAGES_H
+#define LARGE_PAGES_H
+
+#include <stddef.h>
+
+typedef enum page_kind_e
+{
+    REGULAR_PAGES,
+    TRANSPARENT_PAGES,
+    HUGE_PAGES_2MB,
+    HUGE_PAGES_1GB
+}
+page_kind_t;
+
+enum { LargePageSize = 2 * 1024 * 1024 };
+
+// Allocates zeroed memory for large tables, backed by large pages whenever the
+// system allows it. On Linux, explicit huge pages (1GB ones for sizes multiple
+// of 1GB, 2MB ones otherwise) are tried first, then a 2MB-aligned mapping
+// advised for transparent huge pages. On Windows, large pages are used when
+// the user holds the "Lock pages in memory" privilege. Other systems always
+// get regular pages. The kind of pages obtained is written to pageKind if it
+// is not NULL. Returns NULL on failure.
+void *large_pages_alloc(size_t size, page_kind_t *pageKind);
+
+// Frees memory returned by large_pages_alloc(). The size must be the same as
+// the one given for the allocation.
+void large_pages_free(void *ptr, size_t size);
+
+const char *page_kind_name(page_kind_t pageKind);
+
+// Portable replacements for aligned_alloc() and the matching free(), which
+// the Windows C runtime does not provide.
+void *aligned_malloc(size_t alignment, size_t size);
+void aligned_free(void *ptr);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Small LZ77 codec used for compressing dataset blocks.
+//
+// Stream structure: a sequence of tokens, each one made of:
+//  - Token byte: literal count in the high nibble, match length minus 4 in the
+//    low nibble. A nibble value of 15 means that the count continues with
+//    extra bytes, each one adding up to 255 to it (stops at the first byte
+//    different from 255).
+//  - Extra literal count bytes, then the literals themselves
+//  - Match offset (u16, little-endian) and extra match length bytes
+// The last token of the stream only holds literals.
+
+enum
+{
+    LzHashBits = 14
+};
+
+// Match finder state of the compressor. It is too large to live on the stack
+// of each call, so callers keep one per thread and reuse it for all calls.
+typedef struct _LzState
+{
+    uint32_t table[1 << LzHashBits];
+}
+LzState;
+
+// Compresses the given buffer, using the given state as scratch memory.
+// Returns the size of the compressed stream, or zero if it doesn't fit in
+// dstCapacity bytes.
+size_t lz_compress(LzState *state, const unsigned char *src, size_t srcSize, unsigned char *dst, size_t dstCapacity);
+
+// Decompresses the given stream, which must decode to exactly dstSize bytes.
+// Returns zero if successful, non-zero integer if the stream is malformed.
+int lz_decompress(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t dstSize);
+
+#endif
@@ -0,0 +1,32 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <stddef.h>
+
+// Returns the number of NUMA nodes of the system, as listed in /sys. Systems
+// without NUMA support (or without the /sys interface) report a single node.
+int numa_node_count(void);
+
+// Binds the calling thread to the CPUs of the node selected round-robin from
+// the given index. Does nothing on single-node systems.
+void numa_bind_thread(size_t idx);
+
+#endif
@@ -0,0 +1,87 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PACKED_BOARD_H
+#define PACKED_BOARD_H
+
+#include <stdint.h>
+#include "board.h"
+
+// Position record stored as entry input data in position datasets. All fields
+// are byte arrays, so that records can be read from unaligned dataset views
+// and files can be exchanged between systems of different endianness.
+typedef struct packed_board_s
+{
+    uint8_t occupancy[8];       // Occupied squares bitboard, little-endian
+    uint8_t pieces[16];         // Pieces of occupied squares by ascending square
+                                // order, two per byte, low nibble first
+    uint8_t sideToMove;
+    uint8_t castlings;          // Castling rights mask
+    uint8_t enPassantSquare;    // SQ_NONE if not set
+    uint8_t rule50;
+    uint8_t fullmove[2];        // Fullmove counter, little-endian
+    uint8_t castlingFiles[2];   // Rook file of each castling right, 3 bits each
+}
+packed_board_t;
+
+enum
+{
+    PACKED_BLACK_WIN,
+    PACKED_DRAW,
+    PACKED_WHITE_WIN,
+    PACKED_NO_RESULT
+};
+
+// Label stored as entry output data in position datasets.
+typedef struct packed_label_s
+{
+    uint8_t score[2];           // Score from the side to move, little-endian
+    uint8_t bestmove[2];        // Best move found, little-endian
+    uint8_t result;             // Game result from White's point of view
+    uint8_t reserved;
+}
+packed_label_t;
+
+void pack_board(const board_t *board, packed_board_t *pb);
+void unpack_board(const packed_board_t *pb, board_t *board, boardstack_t *stack, bool isChess960);
+hashkey_t packed_board_key(const packed_board_t *pb);
+int packed_board_piece_count(const packed_board_t *pb);
+bool packed_board_in_check(const packed_board_t *pb);
+bool packed_board_is_capture(const packed_board_t *pb, move_t move);
+
+INLINED score_t packed_label_score(const packed_label_t *pl)
+{
+    return ((score_t)(uint16_t)(pl->score[0] | (pl->score[1] << 8)));
+}
+
+INLINED move_t packed_label_move(const packed_label_t *pl)
+{
+    return ((move_t)(pl->bestmove[0] | (pl->bestmove[1] << 8)));
+}
+
+INLINED void packed_label_set(packed_label_t *pl, score_t score, move_t move, int result)
+{
+    pl->score[0] = (uint16_t)score & 0xFF;
+    pl->score[1] = (uint16_t)score >> 8;
+    pl->bestmove[0] = (uint16_t)move & 0xFF;
+    pl->bestmove[1] = (uint16_t)move >> 8;
+    pl->result = (uint8_t)result;
+    pl->reserved = 0;
+}
+
+#endif
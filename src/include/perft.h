@@ -0,0 +1,60 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PERFT_H
+#define PERFT_H
+
+#include <stdatomic.h>
+#include "hashkey.h"
+#include "worker.h"
+
+// Perft hash entry, storing the leaf count of a position at a given depth.
+// The check word is the hash key XORed with the count, so that an entry torn
+// by concurrent writes most likely doesn't match its key anymore.
+typedef struct perft_entry_s
+{
+    _Atomic uint64_t check;
+    _Atomic uint64_t count;
+}
+perft_entry_t;
+
+typedef struct perft_hash_s
+{
+    perft_entry_t *table;
+    size_t entryCount;
+}
+perft_hash_t;
+
+INLINED hashkey_t perft_hash_key(hashkey_t boardKey, unsigned int depth)
+{
+    return (boardKey ^ (depth * 0x9E3779B97F4A7C15ull));
+}
+
+INLINED perft_entry_t *perft_hash_entry(perft_hash_t *hash, hashkey_t key)
+{
+    return (&hash->table[mul_hi64(key, hash->entryCount)]);
+}
+
+// Perft of the pool's root position, called by all workers instead of the
+// regular search when SearchParams.perft is set. The main worker splits the
+// tree into subtrees, which are then handed out to the workers one at a time.
+// Once all subtrees are counted, the main worker prints the count of each
+// root move, followed by the total.
+void worker_perft(worker_t *worker);
+
+#endif // PERFT_H
@@ -0,0 +1,85 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef QSEARCH_CACHE_H
+#define QSEARCH_CACHE_H
+
+#include "hashkey.h"
+#include "tt.h"
+#include "types.h"
+
+// Per-worker cache of qsearch results. Qsearch saves its depth 0 results here
+// instead of in the TT, so that their churn doesn't push deeper entries out of
+// the TT clusters. The cache is direct-mapped and always-replace, with entries
+// indexed by the low bits of the key.
+enum { QsearchCacheSize = 1 << 16 };
+
+typedef struct qsearch_entry_s
+{
+    hashkey_t key;
+    tt_data_t data;
+}
+qsearch_entry_t;
+
+typedef struct qsearch_cache_s
+{
+    qsearch_entry_t *table;
+    uint64_t probes;
+    uint64_t hits;
+}
+qsearch_cache_t;
+
+INLINED qsearch_entry_t *qsearch_cache_entry(const qsearch_cache_t *cache, hashkey_t key)
+{
+    return (&cache->table[key & (QsearchCacheSize - 1)]);
+}
+
+// Copies the cached result for the key to data, with the same layout as TT
+// entries. Returns whether the key has been found.
+INLINED bool qsearch_cache_probe(qsearch_cache_t *cache, hashkey_t key, tt_data_t *data)
+{
+    const qsearch_entry_t *entry = qsearch_cache_entry(cache, key);
+
+    ++cache->probes;
+
+    if (entry->key != key || !entry->data.depth)
+        return (false);
+
+    ++cache->hits;
+    *data = entry->data;
+    data->depth -= TT_DEPTH_OFFSET;
+    return (true);
+}
+
+INLINED void qsearch_cache_store(qsearch_cache_t *cache, hashkey_t key, score_t s, score_t e, int b, move_t m)
+{
+    qsearch_entry_t *entry = qsearch_cache_entry(cache, key);
+
+    entry->key = key;
+    entry->data = (tt_data_t){s, e, TT_DEPTH_OFFSET, (uint8_t)b, (uint16_t)m};
+}
+
+// Allocates the cache if needed, and empties it.
+void qsearch_cache_init(qsearch_cache_t *cache);
+
+// Empties the cache and resets its statistics.
+void qsearch_cache_clear(qsearch_cache_t *cache);
+
+void qsearch_cache_free(qsearch_cache_t *cache);
+
+#endif // QSEARCH_CACHE_H
@@ -19,42 +19,182 @@
 #ifndef TT_H
 #define TT_H
 
+#include <stdatomic.h>
 #include <string.h>
 #include "hashkey.h"
+#include "large_pages.h"
 #include "types.h"
 
-typedef struct tt_entry_s
+// Payload of a TT entry. It fits in 64 bits, so that it can be loaded and
+// stored with a single atomic access.
+typedef struct tt_data_s
 {
-    hashkey_t key;
     score_t score;
     score_t eval;
     uint8_t depth;
     uint8_t genbound;
     uint16_t bestmove;
 }
-tt_entry_t;
+tt_data_t;
+
+_Static_assert(sizeof(tt_data_t) == sizeof(uint64_t), "TT data must fit in 64 bits");
+
+enum
+{
+    ClusterSize = 6,
 
-enum { ClusterSize = 4 };
+    // Depths are stored with an offset, so that a zero depth byte marks an
+    // empty entry.
+    TT_DEPTH_OFFSET = 1
+};
 
+// TT clusters fill exactly one cache line, with the entries stored as arrays of
+// payloads and check words. Only the low 16 bits of the key are stored, since
+// the cluster index already comes from its high bits.
+//
+// TT entries are accessed by all workers without locking. The check word is
+// the key bits XORed with a 16-bit fold of the payload, so that an entry torn
+// by concurrent writes most likely doesn't match its key anymore and is simply
+// treated as a miss. All accesses use relaxed atomics, which compile to plain
+// loads and stores.
+//
+// Each cluster also records the table epoch it was last written in, in the
+// spare bytes of its cache line. Bumping the table epoch discards all entries
+// at once: clusters from an older epoch count as empty, and are wiped the
+// first time they get probed.
 typedef struct cluster_s
 {
-    tt_entry_t clEntry[ClusterSize];
+    _Alignas(64) _Atomic uint64_t data[ClusterSize];
+    _Atomic uint16_t check[ClusterSize];
+    _Atomic uint16_t epoch;
 }
 cluster_t;
 
+_Static_assert(sizeof(cluster_t) == 64, "TT clusters must fit in a cache line");
+
+// Reference to a single entry of a cluster.
+typedef struct tt_entry_s
+{
+    cluster_t *cluster;
+    int index;
+}
+tt_entry_t;
+
+// Reasons for which tt_save() wrote an entry.
+typedef enum tt_save_reason_e
+{
+    TT_SAVE_EMPTY,   // the slot was empty
+    TT_SAVE_STALE,   // the slot held an entry from an older search
+    TT_SAVE_EVICT,   // the slot held an entry from the current search
+    TT_SAVE_UPDATE,  // the slot held the same position, and got overwritten
+    TT_SAVE_KEEP,    // the slot held the same position with a higher depth
+    TT_SAVE_NB
+}
+tt_save_reason_t;
+
+enum
+{
+    // Hits with a higher depth are counted in the last bucket.
+    TTStatsDepths = 32,
+
+    // Number of generations tracked by tt_age_counts(), the last bucket
+    // counting all entries which are at least that old.
+    TTStatsAges = 8
+};
+
+// TT usage counters. Each worker keeps its own copy, so that counting never
+// causes cache-line sharing between threads. Only the owning worker updates
+// them, but the UCI thread reads them while searching, so all accesses go
+// through tt_stat() and tt_stat_add() like the node counters.
+typedef struct tt_stats_s
+{
+    _Atomic uint64_t probes;
+    _Atomic uint64_t hits;
+    _Atomic uint64_t hitDepths[TTStatsDepths];
+    _Atomic uint64_t saves[TT_SAVE_NB];
+    _Atomic uint64_t collisions;
+
+    // Number of entries claimed for the current generation since the start of
+    // the search, used for computing hashfull.
+    _Atomic uint64_t fills;
+}
+tt_stats_t;
+
+INLINED uint64_t tt_stat(const _Atomic uint64_t *counter)
+{
+    return (atomic_load_explicit(counter, memory_order_relaxed));
+}
+
+INLINED void tt_stat_set(_Atomic uint64_t *counter, uint64_t value)
+{
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+INLINED void tt_stat_add(_Atomic uint64_t *counter, uint64_t value)
+{
+    tt_stat_set(counter, tt_stat(counter) + value);
+}
+
 typedef struct transposition_s
 {
     size_t clusterCount;
     cluster_t *table;
     uint8_t generation;
+    uint16_t epoch;
+    page_kind_t pageKind;
 }
 transposition_t;
 
 extern transposition_t TT;
 
-INLINED tt_entry_t *tt_entry_at(hashkey_t k)
+INLINED cluster_t *tt_cluster_at(const transposition_t *tt, hashkey_t k)
 {
-    return (TT.table[mul_hi64(k, TT.clusterCount)].clEntry);
+    return (&tt->table[mul_hi64(k, tt->clusterCount)]);
+}
+
+INLINED uint64_t tt_pack_data(tt_data_t data)
+{
+    uint64_t packed;
+
+    memcpy(&packed, &data, sizeof(packed));
+    return (packed);
+}
+
+INLINED tt_data_t tt_unpack_data(uint64_t packed)
+{
+    tt_data_t data;
+
+    memcpy(&data, &packed, sizeof(data));
+    return (data);
+}
+
+INLINED uint16_t tt_check_word(hashkey_t key, uint64_t packed)
+{
+    return ((uint16_t)(key ^ packed ^ (packed >> 16) ^ (packed >> 32) ^ (packed >> 48)));
+}
+
+// Loads a snapshot of the entry, with the depth still offset. Returns whether
+// the snapshot is consistent and belongs to the given key.
+INLINED bool tt_load_entry(const cluster_t *cluster, int index, hashkey_t key, tt_data_t *data)
+{
+    uint64_t packed = atomic_load_explicit(&cluster->data[index], memory_order_relaxed);
+    uint16_t check = atomic_load_explicit(&cluster->check[index], memory_order_relaxed);
+
+    *data = tt_unpack_data(packed);
+    return (check == tt_check_word(key, packed));
+}
+
+INLINED void tt_store_entry(cluster_t *cluster, int index, hashkey_t key, tt_data_t data)
+{
+    uint64_t packed = tt_pack_data(data);
+
+    atomic_store_explicit(&cluster->data[index], packed, memory_order_relaxed);
+    atomic_store_explicit(&cluster->check[index], tt_check_word(key, packed), memory_order_relaxed);
+}
+
+INLINED bool tt_cluster_is_stale(const transposition_t *tt, const cluster_t *cluster)
+{
+    return (atomic_load_explicit(&cluster->epoch, memory_order_relaxed) != tt->epoch);
 }
 
 INLINED void tt_clear(void)
@@ -62,6 +202,10 @@ INLINED void tt_clear(void)
     TT.generation += 4;
 }
 
+// Discards all entries without touching the table, except when the epoch
+// counter wraps around, where the table gets zeroed for real.
+void tt_discard(void);
+
 INLINED score_t score_to_tt(score_t s, int plies)
 {
     return (s >= MATE_FOUND ? s + plies : s <= -MATE_FOUND ? s - plies : s);
@@ -73,9 +217,35 @@ INLINED score_t score_from_tt(score_t s, int plies)
 }
 
 void tt_bzero(size_t threadCount);
-tt_entry_t *tt_probe(hashkey_t key, bool *found);
-void tt_save(tt_entry_t *entry, hashkey_t k, score_t s, score_t e, int d, int b, move_t m);
-int tt_hashfull(void);
+
+// Looks up the key in the given table, and returns the entry to use for saving
+// search results. The entry payload is copied to data, which is only
+// meaningful when found is set.
+tt_entry_t tt_probe(transposition_t *tt, tt_stats_t *stats, hashkey_t key, bool *found, tt_data_t *data);
+void tt_save(transposition_t *tt, tt_stats_t *stats, tt_entry_t entry, hashkey_t k, score_t s, score_t e, int d, int b, move_t m);
+
+// Scans the whole table, and counts the number of empty entries, followed by
+// the number of entries for each generation age.
+void tt_age_counts(uint64_t counts[TTStatsAges + 1]);
 void tt_resize(size_t mbsize);
 
+// Dumps the whole table to the given file. Returns zero if successful, non-zero
+// integer otherwise.
+int tt_write_file(const char *filename);
+
+// Loads a table dumped by tt_write_file(), using the given number of threads.
+// The table size must match the current one. Returns zero if successful,
+// non-zero integer otherwise.
+int tt_read_file(const char *filename, size_t threadCount);
+
+// Allocates a small table, independent from the global one, for searches
+// which must not share their entries with others. Returns zero if successful,
+// non-zero integer otherwise.
+int tt_table_alloc(transposition_t *tt, size_t mbsize);
+
+// Discards all entries of a table allocated with tt_table_alloc().
+void tt_table_discard(transposition_t *tt);
+
+void tt_table_free(transposition_t *tt);
+
 #endif // TT_H
@@ -44,9 +44,11 @@ typedef struct ucioptions_s
     long hash;
     long moveOverhead;
     long multiPv;
+    long evalCache;
     char *networkFile;
     bool chess960;
     bool ponder;
+    bool abdada;
 }
 ucioptions_t;
 
@@ -54,10 +56,20 @@ extern pthread_attr_t WorkerSettings;
 extern ucioptions_t Options;
 extern const char *Delimiters;
 
+// Defines how commands are scheduled relative to searches.
+typedef enum cmd_kind_e
+{
+    CMD_FLAG,    // only sets search flags, also executed by the input thread
+    CMD_QUEUED,  // executed by the command thread, even during searches
+    CMD_IDLE     // executed by the command thread, once the search is over
+}
+cmd_kind_t;
+
 typedef struct cmdlink_s
 {
     const char *commandName;
     void (*call)(const char *);
+    cmd_kind_t kind;
 }
 cmdlink_t;
 
@@ -70,13 +82,17 @@ move_t str_to_move(const board_t *board, const char *str);
 void uci_bench(const char *args);
 void uci_d(const char *args);
 void uci_debug(const char *args);
+void uci_dedup(const char *args);
 void uci_go(const char *args);
 void uci_isready(const char *args);
+void uci_pack(const char *args);
 void uci_ponderhit(const char *args);
 void uci_position(const char *args);
 void uci_quit(const char *args);
+void uci_rescore(const char *args);
 void uci_setoption(const char *args);
 void uci_stop(const char *args);
+void uci_tt(const char *args);
 void uci_uci(const char *args);
 void uci_ucinewgame(const char *args);
 void uci_loop(int argc, char **argv);
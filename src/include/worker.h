@@ -2,9 +2,14 @@
 #define WORKER_H
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include "board.h"
+#include "eval_cache.h"
 #include "history.h"
+#include "movelist.h"
 #include "pawns.h"
+#include "qsearch_cache.h"
+#include "tt.h"
 #include "uci.h"
 
 // Struct for search params.
@@ -21,6 +26,7 @@ typedef struct goparams_s
     int mate;
     int infinite;
     int perft;
+    int perftHash;
     int ponder;
     clock_t movetime;
 }
@@ -28,7 +34,18 @@ goparams_t;
 
 extern goparams_t SearchParams;
 
-// Struct for root moves.
+enum
+{
+    MaxRootMoves = 256,
+
+    // Search PVs are stored in arrays of 256 moves, and never exceed MAX_PLIES
+    // moves.
+    RootPvSize = 256
+};
+
+// Struct for root moves. The PV lives in a buffer owned by the worker, so that
+// sorting root moves only moves a few bytes around. Each root move keeps its
+// buffer across searches.
 
 typedef struct root_move_s
 {
@@ -36,7 +53,7 @@ typedef struct root_move_s
     int seldepth;
     score_t prevScore;
     score_t score;
-    move_t  pv[512];
+    move_t  *pv;
 }
 root_move_t;
 
@@ -50,20 +67,42 @@ void print_pv(const board_t *board, root_move_t *rootMove, int multiPv,
 typedef struct worker_s
 {
     board_t board;
-    boardstack_t *stack;
+    size_t accSize;
     butterfly_history_t bfHistory;
     continuation_history_t ctHistory;
     countermove_history_t cmHistory;
     capture_history_t capHistory;
     pawn_entry_t *pawnTable;
+    eval_cache_t evalCache;
+    qsearch_cache_t qsCache;
 
     int seldepth;
     int verifPlies;
-    _Atomic uint64_t nodes;
 
+    // The node counter is only written by its owner, with relaxed accesses
+    // which compile to plain loads and stores. It lives on its own cache line,
+    // so that other threads summing node counts don't disturb the accesses to
+    // the surrounding fields. (Workers are allocated with cache-line alignment
+    // for this.)
+    _Alignas(64) _Atomic uint64_t nodes;
+    _Alignas(64) tt_stats_t ttStats;
+
+    // Allocated once with room for MaxRootMoves entries, and reused by all
+    // searches.
     root_move_t *rootMoves;
+    move_t *rootPvs;
     size_t rootCount;
     int pvLine;
+    int completedDepth;
+
+    // Table used by the searches of the worker, which is the global TT except
+    // for searches run outside of the pool.
+    transposition_t *tt;
+
+    // Node budget of searches run outside of the pool, which only aborts the
+    // search of this worker. Pool searches leave it unlimited, and enforce
+    // "go nodes" from check_time() instead.
+    uint64_t nodeLimit;
 
     size_t idx;
     pthread_t thread;
@@ -79,9 +118,35 @@ INLINED worker_t *get_worker(const board_t *board)
     return (board->worker);
 }
 
+INLINED uint64_t worker_nodes(const worker_t *worker)
+{
+    return (atomic_load_explicit(&worker->nodes, memory_order_relaxed));
+}
+
+INLINED void worker_set_nodes(worker_t *worker, uint64_t nodes)
+{
+    atomic_store_explicit(&worker->nodes, nodes, memory_order_relaxed);
+}
+
+// Must only be called by the worker owning the counter. Boards used by the
+// UCI layer have no worker attached, and their moves aren't counted.
+INLINED void worker_count_node(worker_t *worker)
+{
+    if (worker != NULL)
+        worker_set_nodes(worker, worker_nodes(worker) + 1);
+}
+
+// Prefetches the cluster of the given key from the table of the worker. Boards
+// used by the UCI layer have no worker, and don't need it.
+INLINED void worker_prefetch_tt(const worker_t *worker, hashkey_t key)
+{
+    if (worker != NULL)
+        prefetch(tt_cluster_at(worker->tt, key));
+}
+
 INLINED score_t draw_score(const worker_t *worker)
 {
-    return (worker->nodes & 2) - 1;
+    return (worker_nodes(worker) & 2) - 1;
 }
 
 void worker_init(worker_t *worker, size_t idx);
@@ -89,24 +154,65 @@ void worker_destroy(worker_t *worker);
 void worker_search(worker_t *worker);
 void main_worker_search(worker_t *worker);
 void worker_reset(worker_t *worker);
+
+// Scales down the butterfly, capture and continuation histories before a new
+// search of the same game.
+void worker_age_histories(worker_t *worker);
 void worker_start_search(worker_t *worker);
 void worker_wait_search_end(worker_t *worker);
 void *worker_entry(void *worker);
 
+// Engine states, as seen by the UCI layer.
+typedef enum engine_state_e
+{
+    ENGINE_IDLE,
+    ENGINE_SEARCHING,
+    ENGINE_PONDERING
+}
+engine_state_t;
+
+// The pool fields are split over separate cache lines by access pattern, so
+// that the check counter decremented by the main worker at every node never
+// invalidates the line holding the flags polled by all workers.
 typedef struct worker_pool_s
 {
+    // Read-only during searches.
     size_t size;
-    int checks;
+    worker_t **workerList;
 
-    _Atomic bool ponder;
-    _Atomic bool stop;
+    // Copy of the root position, taken when the search starts, that the
+    // workers copy in parallel while setting up their search. The workers'
+    // boards share the copied stack entries, which are never written to
+    // during searches. Only the entries which can be reached by repetition
+    // detection are copied.
+    board_t rootBoard;
+    boardstack_t *rootStacks;
+    size_t rootStackCapacity;
+    size_t rootAccSize;
 
-    worker_t **workerList;
+    // Used by the main worker for sleeping until the stop or the ponderhit
+    // comes in, instead of polling the flags.
+    pthread_mutex_t waitMutex;
+    pthread_cond_t waitCondVar;
+
+    // Only accessed by the main worker.
+    _Alignas(64) int checks;
+
+    // Polled by all workers, and rarely written.
+    _Alignas(64) _Atomic bool ponder;
+    _Atomic bool stop;
+    _Atomic engine_state_t state;
 }
 worker_pool_t;
 
 extern worker_pool_t WPool;
 
+// Returns whether the search of the worker must be aborted.
+INLINED bool worker_must_stop(const worker_t *worker)
+{
+    return (WPool.stop || worker_nodes(worker) >= worker->nodeLimit);
+}
+
 INLINED worker_t *wpool_main_worker(worker_pool_t *wpool)
 {
     return wpool->workerList[0];
@@ -114,10 +220,40 @@ INLINED worker_t *wpool_main_worker(worker_pool_t *wpool)
 
 void wpool_init(worker_pool_t *wpool, size_t threads);
 void wpool_reset(worker_pool_t *wpool);
+
+// Waits for the previous search to end, and starts a new one. The root board,
+// the search parameters and the root moves are copied, so that the caller can
+// reuse them right away.
 void wpool_start_search(worker_pool_t *wpool, const board_t *rootBoard,
-    const goparams_t *searchParams);
+    const goparams_t *searchParams, const movelist_t *searchMoves);
 void wpool_start_workers(worker_pool_t *wpool);
 void wpool_wait_search_end(worker_pool_t *wpool);
+
+// Sets the stop or clears the ponder flag, and wakes up the main worker if it
+// is waiting in wpool_wait_release(). A ponderhit is ignored if the engine
+// isn't pondering.
+void wpool_stop(worker_pool_t *wpool);
+void wpool_ponderhit(worker_pool_t *wpool);
+
+// Blocks until the search is stopped, or until the ponderhit comes in for
+// non-infinite searches.
+void wpool_wait_release(worker_pool_t *wpool);
+
+// Selects the worker whose best root move should be played, combining the
+// completed depths and scores of all workers. Must only be called once all
+// workers have stopped searching.
+worker_t *select_best_worker(worker_pool_t *wpool);
+
 uint64_t wpool_get_total_nodes(worker_pool_t *wpool);
 
+// Sums the TT counters of all workers.
+void wpool_get_tt_stats(worker_pool_t *wpool, tt_stats_t *stats);
+
+// Sets the number of TT entries claimed for the current generation, which
+// wpool_hashfull() builds upon.
+void wpool_set_tt_fills(worker_pool_t *wpool, uint64_t fills);
+
+// Returns the permill of TT entries used by the current search.
+int wpool_hashfull(worker_pool_t *wpool);
+
 #endif
\ No newline at end of file
@@ -16,6 +16,7 @@
 **    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -23,12 +24,176 @@
 #include "board.h"
 #include "timeman.h"
 
+enum
+{
+    MaxScalingRuns = 16,
+    MaxScalingRepeats = 64,
+    DefaultScalingRepeats = 3
+};
+
+// Searches all the given positions at the given depth, and returns the total
+// node count.
+
+static uint64_t bench_search(const char *const *positions, const char *depth)
+{
+    uint64_t totalNodes = 0;
+
+    for (size_t i = 0; positions[i]; ++i)
+    {
+        char buf[4096];
+
+        strcpy(buf, "depth ");
+        strcat(buf, depth);
+        uci_ucinewgame(NULL);
+        uci_position(positions[i]);
+        uci_go(buf);
+        worker_wait_search_end(wpool_main_worker(&WPool));
+
+        // Retrieve the node counter.
+
+        totalNodes += wpool_get_total_nodes(&WPool);
+    }
+
+    return (totalNodes);
+}
+
+static void set_bench_threads(long threads)
+{
+    Options.threads = threads;
+    wpool_init(&WPool, (size_t)threads);
+    worker_wait_search_end(wpool_main_worker(&WPool));
+}
+
+// Computes the mean and the sample standard deviation of the given values.
+
+static void mean_stdev(const double *values, int count, double *mean, double *stdev)
+{
+    double sum = 0.0;
+    double sqSum = 0.0;
+
+    for (int i = 0; i < count; ++i)
+        sum += values[i];
+
+    *mean = sum / count;
+
+    for (int i = 0; i < count; ++i)
+        sqSum += (values[i] - *mean) * (values[i] - *mean);
+
+    *stdev = (count > 1) ? sqrt(sqSum / (count - 1)) : 0.0;
+}
+
+// Runs the bench with 1, 2, 4... threads up to the given count, and reports
+// the speedup of each thread count compared to the single-threaded one. Since
+// all searches are done at fixed depth, the time speedup is the time-to-depth
+// speedup of the parallel search. Multi-threaded searches are not
+// deterministic, so each thread count is run several times, and the report
+// gives the mean and standard deviation over the repetitions.
+
+static void bench_scaling(const char *const *positions, const char *depth, long maxThreads, int repeats)
+{
+    const long savedThreads = Options.threads;
+    long threads[MaxScalingRuns];
+    double times[MaxScalingRuns][MaxScalingRepeats];
+    double nodes[MaxScalingRuns][MaxScalingRepeats];
+    int runs = 0;
+
+    for (long t = 1; runs < MaxScalingRuns; t *= 2)
+    {
+        threads[runs++] = (t < maxThreads) ? t : maxThreads;
+
+        if (t >= maxThreads)
+            break ;
+    }
+
+    // Go through all thread counts for each repetition, so that any drift of
+    // the machine speed affects all of them alike.
+
+    for (int r = 0; r < repeats; ++r)
+        for (int i = 0; i < runs; ++i)
+        {
+            set_bench_threads(threads[i]);
+
+            clock_t time = chess_clock();
+
+            nodes[i][r] = (double)bench_search(positions, depth);
+            times[i][r] = (double)(chess_clock() - time);
+        }
+
+    set_bench_threads(savedThreads);
+
+    printf("Scaling report (depth %s, %d runs, mean +/- standard deviation):\n", depth, repeats);
+    printf("Threads        Time (ms)        Nodes               NPS   NPS speedup   TTD speedup\n");
+
+    for (int i = 0; i < runs; ++i)
+    {
+        double nps[MaxScalingRepeats];
+        double npsSpeedup[MaxScalingRepeats];
+        double ttdSpeedup[MaxScalingRepeats];
+        double timeMean, timeStdev, nodesMean, nodesStdev;
+        double npsMean, npsStdev, npsSpeedupMean, npsSpeedupStdev;
+        double ttdSpeedupMean, ttdSpeedupStdev;
+
+        // Speedups are computed against the single-threaded run of the same
+        // repetition.
+
+        for (int r = 0; r < repeats; ++r)
+        {
+            nps[r] = nodes[i][r] * 1000.0 / fmax(times[i][r], 1.0);
+            npsSpeedup[r] = nps[r] / fmax(nodes[0][r] * 1000.0 / fmax(times[0][r], 1.0), 1.0);
+            ttdSpeedup[r] = times[0][r] / fmax(times[i][r], 1.0);
+        }
+
+        mean_stdev(times[i], repeats, &timeMean, &timeStdev);
+        mean_stdev(nodes[i], repeats, &nodesMean, &nodesStdev);
+        mean_stdev(nps, repeats, &npsMean, &npsStdev);
+        mean_stdev(npsSpeedup, repeats, &npsSpeedupMean, &npsSpeedupStdev);
+        mean_stdev(ttdSpeedup, repeats, &ttdSpeedupMean, &ttdSpeedupStdev);
+
+        printf("%7ld %9.0f +/- %-5.0f %12.0f %10.0f +/- %-5.0f %5.2fx +/- %.2f %5.2fx +/- %.2f\n",
+            threads[i], timeMean, timeStdev, nodesMean, npsMean, npsStdev,
+            npsSpeedupMean, npsSpeedupStdev, ttdSpeedupMean, ttdSpeedupStdev);
+    }
+
+    fflush(stdout);
+}
+
 void uci_bench(const char *args)
 {
+    char *copy = strdup(args ? args : "");
+    char *token = strtok(copy, Delimiters);
+    const char *depth = "13";
+    long scalingThreads = 0;
+    int scalingRepeats = DefaultScalingRepeats;
+
     // If bench depth isn't given, use default depth of 13.
 
-    if (!args || !atoi(args))
-        args = "13";
+    if (token && atoi(token) > 0)
+    {
+        depth = token;
+        token = strtok(NULL, Delimiters);
+    }
+
+    if (token && !strcmp(token, "scaling"))
+    {
+        token = strtok(NULL, Delimiters);
+        scalingThreads = token ? atol(token) : 0;
+        token = strtok(NULL, Delimiters);
+
+        if (token && !strcmp(token, "runs"))
+        {
+            token = strtok(NULL, Delimiters);
+            scalingRepeats = token ? atoi(token) : 0;
+        }
+
+        if (scalingThreads < 1 || scalingThreads > 256
+            || scalingRepeats < 1 || scalingRepeats > MaxScalingRepeats)
+        {
+            puts("info string Usage: bench [depth] [scaling <threads> [runs <n>]]");
+            fflush(stdout);
+            free(copy);
+            return ;
+        }
+    }
 
     // List of positions to search
 
@@ -86,25 +251,16 @@ void uci_bench(const char *args)
         NULL
     };
 
-    clock_t benchTime = chess_clock();
-    uint64_t totalNodes = 0;
-
-    for (size_t i = 0; positions[i]; ++i)
+    if (scalingThreads)
     {
-        char buf[4096];
-
-        strcpy(buf, "depth ");
-        strcat(buf, args);
-        uci_ucinewgame(NULL);
-        uci_position(positions[i]);
-        uci_go(buf);
-        worker_wait_search_end(wpool_main_worker(&WPool));
-
-        // Retrieve the node counter.
-
-        totalNodes += wpool_get_total_nodes(&WPool);
+        bench_scaling(positions, depth, scalingThreads, scalingRepeats);
+        free(copy);
+        return ;
     }
 
+    clock_t benchTime = chess_clock();
+    uint64_t totalNodes = bench_search(positions, depth);
+
     benchTime = chess_clock() - benchTime;
 
     printf("Benchmark report:\n");
@@ -112,4 +268,5 @@ void uci_bench(const char *args)
     printf("NODES: %" FMT_INFO "\n", (info_t)totalNodes);
     printf("NPS:   %" FMT_INFO "\n", (info_t)((totalNodes * 1000) / benchTime));
     fflush(stdout);
+    free(copy);
 }
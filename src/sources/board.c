@@ -351,9 +351,46 @@ const char *board_fen(const board_t *board)
     return fenBuffer;
 }
 
+hashkey_t board_key_after(const board_t *board, move_t move)
+{
+    color_t us = board->sideToMove, them = not_color(us);
+    square_t from = from_sq(move), to = to_sq(move);
+    piece_t piece = piece_on(board, from);
+    piece_t capturedPiece = move_type(move) == EN_PASSANT ? create_piece(them, PAWN) : piece_on(board, to);
+    hashkey_t key = board->stack->boardKey ^ ZobristBlackToMove;
+
+    // Castling moves are encoded as 'King takes own Rook'.
+
+    if (move_type(move) == CASTLING)
+    {
+        bool kingside = to > from;
+
+        key ^= ZobristPsq[capturedPiece][to];
+        key ^= ZobristPsq[capturedPiece][relative_sq(kingside ? SQ_F1 : SQ_D1, us)];
+        to = relative_sq(kingside ? SQ_G1 : SQ_C1, us);
+    }
+    else if (capturedPiece)
+        key ^= ZobristPsq[capturedPiece][move_type(move) == EN_PASSANT ? to - pawn_direction(us) : to];
+
+    key ^= ZobristPsq[piece][from];
+    key ^= ZobristPsq[move_type(move) == PROMOTION ? create_piece(us, promotion_type(move)) : piece][to];
+
+    if (board->stack->enPassantSquare != SQ_NONE)
+        key ^= ZobristEnPassant[sq_file(board->stack->enPassantSquare)];
+
+    if (board->stack->castlings && (board->castlingMask[from] | board->castlingMask[to]))
+        key ^= ZobristCastling[board->stack->castlings & (board->castlingMask[from] | board->castlingMask[to])];
+
+    if (piece_type(piece) == PAWN && (to ^ from) == 16
+        && (pawn_moves(to - pawn_direction(us), us) & piece_bb(board, them, PAWN)))
+        key ^= ZobristEnPassant[sq_file(to - pawn_direction(us))];
+
+    return (key);
+}
+
 void do_move_gc(board_t *board, move_t move, boardstack_t *next, bool givesCheck)
 {
-    get_worker(board)->nodes += 1;
+    worker_count_node(get_worker(board));
 
     hashkey_t key = board->stack->boardKey ^ ZobristBlackToMove;
 
@@ -461,7 +498,7 @@ void do_move_gc(board_t *board, move_t move, boardstack_t *next, bool givesCheck
     board->stack->capturedPiece = capturedPiece;
     board->stack->boardKey = key;
 
-    prefetch(tt_entry_at(key));
+    worker_prefetch_tt(get_worker(board), key);
 
     board->stack->checkers = givesCheck
         ? attackers_to(board, get_king_square(board, them)) & color_bb(board, us)
@@ -561,7 +598,7 @@ void undo_castling(board_t *board, color_t us, square_t kingFrom, square_t *king
 
 void do_null_move(board_t *board, boardstack_t *stack)
 {
-    get_worker(board)->nodes += 1;
+    worker_count_node(get_worker(board));
 
     memcpy(stack, board->stack, sizeof(boardstack_t));
     stack->prev = board->stack;
@@ -574,7 +611,7 @@ void do_null_move(board_t *board, boardstack_t *stack)
     }
 
     stack->boardKey ^= ZobristBlackToMove;
-    prefetch(tt_entry_at(stack->boardKey));
+    worker_prefetch_tt(get_worker(board), stack->boardKey);
 
     ++stack->rule50;
     stack->pliesFromNullMove = 0;
@@ -1,8 +1,56 @@
-#include <math.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "dataset.h"
+#include "lz.h"
+
+static uint32_t CrcTable[256];
+static pthread_once_t CrcTableOnce = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        uint32_t c = i;
+
+        for (int k = 0; k < 8; ++k)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+
+        CrcTable[i] = c;
+    }
+}
+
+// Computes the standard CRC-32 (as used by zlib or PNG) of the given buffer.
+uint32_t dataset_crc32(const void *data, size_t size)
+{
+    const unsigned char *ptr = data;
+    uint32_t crc = 0xFFFFFFFFu;
+
+    pthread_once(&CrcTableOnce, &crc_table_init);
+
+    for (size_t i = 0; i < size; ++i)
+        crc = CrcTable[(crc ^ ptr[i]) & 0xFF] ^ (crc >> 8);
+
+    return (crc ^ 0xFFFFFFFFu);
+}
+
+static void write_u32le(unsigned char *ptr, uint32_t u)
+{
+    ptr[0] = (u >>  0) & 0xFF;
+    ptr[1] = (u >>  8) & 0xFF;
+    ptr[2] = (u >> 16) & 0xFF;
+    ptr[3] = (u >> 24) & 0xFF;
+}
+
+static uint32_t read_u32le(const unsigned char *ptr)
+{
+    return ((uint32_t)ptr[0] <<  0)
+         | ((uint32_t)ptr[1] <<  8)
+         | ((uint32_t)ptr[2] << 16)
+         | ((uint32_t)ptr[3] << 24);
+}
 
 void dataset_init(Dataset *d, size_t inputSize, size_t outputSize)
 {
@@ -11,6 +59,9 @@ void dataset_init(Dataset *d, size_t inputSize, size_t outputSize)
     d->entries = NULL;
     d->entryCount = 0;
     d->entryMaxCount = 0;
+    d->payload = NULL;
+    d->payloadSize = 0;
+    d->payloadMaxSize = 0;
     d->decode = NULL;
 }
 
@@ -19,98 +70,985 @@ void dataset_set_data_decoder(Dataset *d, decoder_t decode)
     d->decode = decode;
 }
 
-int dataset_add_entry(Dataset *d, const void *inData, const void *outData, size_t inSize, size_t outSize)
+int dataset_reserve(Dataset *d, size_t entryCount, size_t payloadSize)
 {
-    if (d->entryCount == d->entryMaxCount)
+    if (entryCount > d->entryMaxCount)
     {
-        // Use a quadratic growth scheme for the entry buffer.
-
-        size_t newSize = (d->entryMaxCount == 0) ? 16
-            : d->entryMaxCount + (int)sqrt(d->entryMaxCount) * 2;
-        void *newPtr = realloc(d->entries, sizeof(DatasetEntry) * newSize);
+        void *newPtr = realloc(d->entries, sizeof(DatasetEntry) * entryCount);
 
         if (newPtr == NULL)
-        {
-            perror("dataset_add_entry(): error");
             return (-1);
-        }
 
-        d->entryMaxCount = newSize;
         d->entries = newPtr;
+        d->entryMaxCount = entryCount;
     }
 
-    DatasetEntry *cur = d->entries + d->entryCount;
+    if (payloadSize > d->payloadMaxSize)
+    {
+        void *newPtr = realloc(d->payload, payloadSize);
 
-    cur->inSize = (d->decode == NULL) ? sizeof(weight_t) * d->inputSize : inSize;
-    cur->outSize = (d->decode == NULL) ? sizeof(weight_t) * d->outputSize : outSize;
-    cur->inData = malloc(cur->inSize);
-    cur->outData = malloc(cur->outSize);
+        if (newPtr == NULL)
+            return (-1);
+
+        d->payload = newPtr;
+        d->payloadMaxSize = payloadSize;
+    }
+
+    return (0);
+}
 
-    if (cur->inData == NULL || cur->outData == NULL)
+int dataset_add_entry(Dataset *d, const void *inData, const void *outData, size_t inSize, size_t outSize)
+{
+    if (d->decode == NULL)
+    {
+        inSize = sizeof(weight_t) * d->inputSize;
+        outSize = sizeof(weight_t) * d->outputSize;
+    }
+
+    if (inSize > UINT32_MAX || outSize > UINT32_MAX)
+    {
+        fputs("dataset_add_entry(): error: entry too large\n", stderr);
+        return (-1);
+    }
+
+    // Use a geometric growth scheme for both the entry and payload buffers,
+    // so that the cost of reallocations stays amortized constant per entry.
+
+    size_t newEntryCount = d->entryMaxCount;
+    size_t newPayloadSize = d->payloadMaxSize;
+
+    if (d->entryCount == d->entryMaxCount)
+        newEntryCount = (d->entryMaxCount == 0) ? 1024 : d->entryMaxCount * 2;
+
+    while (d->payloadSize + inSize + outSize > newPayloadSize)
+        newPayloadSize = (newPayloadSize == 0) ? 65536 : newPayloadSize * 2;
+
+    if (dataset_reserve(d, newEntryCount, newPayloadSize))
     {
         perror("dataset_add_entry(): error");
-        free(cur->inData);
-        free(cur->outData);
         return (-1);
     }
 
-    memcpy(cur->inData, inData, cur->inSize);
-    memcpy(cur->outData, outData, cur->outSize);
+    DatasetEntry *cur = d->entries + d->entryCount;
+
+    cur->offset = d->payloadSize;
+    cur->inSize = (uint32_t)inSize;
+    cur->outSize = (uint32_t)outSize;
+
+    memcpy(d->payload + cur->offset, inData, inSize);
+    memcpy(d->payload + cur->offset + inSize, outData, outSize);
+    d->payloadSize += inSize + outSize;
     d->entryCount++;
     return (0);
 }
 
 int dataset_push_entries(Dataset *d, const char *filename)
 {
-    FILE *f = fopen(filename, "ab");
+    DatasetWriter w;
 
-    if (f == NULL)
-    {
-        perror("dataset_push_entries(): unable to open file");
+    if (dataset_writer_open(&w, filename))
         return (-1);
-    }
 
-    for (size_t i = 0; i < d->entryCount; ++d)
+    for (size_t i = 0; i < d->entryCount; ++i)
     {
-        DatasetEntry *cur = d->entries + i;
+        DatasetView cur = dataset_entry_view(d, i);
 
-        if (fwrite(&cur->inSize, sizeof(size_t), 1, f) != 1
-            || fwrite(&cur->outSize, sizeof(size_t), 1, f) != 1
-            || fwrite(cur->inData, 1, cur->inSize, f) != cur->inSize
-            || fwrite(cur->outData, 1, cur->outSize, f) != cur->outSize)
+        if (dataset_writer_append(&w, cur.inData, cur.outData, cur.inSize, cur.outSize))
         {
-            perror("dataset_push_entries(): unable to write entry to file");
-            fclose(f);
+            dataset_writer_close(&w);
             return (-2);
         }
     }
 
-    for (size_t i = 0; i < d->entryCount; ++i)
-    {
-        free(d->entries[i].inData);
-        free(d->entries[i].outData);
-    }
-    free(d->entries);
+    if (dataset_writer_close(&w))
+        return (-2);
 
-    d->entries = NULL;
-    d->entryCount = 0;
-    d->entryMaxCount = 0;
-    fclose(f);
+    dataset_clear(d);
     return (0);
 }
 
+void dataset_clear(Dataset *d)
+{
+    d->entryCount = 0;
+    d->payloadSize = 0;
+}
+
 void dataset_destroy(Dataset *d)
 {
-    for (size_t i = 0; i < d->entryCount; ++i)
-    {
-        free(d->entries[i].inData);
-        free(d->entries[i].outData);
-    }
     free(d->entries);
+    free(d->payload);
     d->inputSize = 0;
     d->outputSize = 0;
     d->entries = NULL;
     d->entryCount = 0;
     d->entryMaxCount = 0;
+    d->payload = NULL;
+    d->payloadSize = 0;
+    d->payloadMaxSize = 0;
     d->decode = NULL;
 }
+
+// Checks the file header, and sets versionFlags to the block flags allowed by
+// the file version.
+static int dataset_check_header(FILE *f, const char *funcName, uint32_t *versionFlags)
+{
+    unsigned char header[DatasetHeaderSize];
+    uint32_t version;
+
+    if (fread(header, 1, DatasetHeaderSize, f) != DatasetHeaderSize
+        || memcmp(header, DATASET_MAGIC, 4))
+    {
+        fprintf(stderr, "%s: error: not a dataset file\n", funcName);
+        return (-1);
+    }
+
+    version = read_u32le(header + 4);
+
+    if (version < 1 || version > DatasetVersion)
+    {
+        fprintf(stderr, "%s: error: unsupported dataset version %lu\n",
+            funcName, (unsigned long)version);
+        return (-1);
+    }
+
+    *versionFlags = (version >= 2) ? DatasetKnownFlags : 0;
+    return (0);
+}
+
+static int dataset_grow_block(unsigned char **block, size_t *maxSize, size_t size)
+{
+    if (size <= *maxSize)
+        return (0);
+
+    size_t newSize = (*maxSize == 0) ? DatasetBlockSize : *maxSize;
+
+    while (newSize < size)
+        newSize *= 2;
+
+    void *newPtr = realloc(*block, newSize);
+
+    if (newPtr == NULL)
+        return (-1);
+
+    *block = newPtr;
+    *maxSize = newSize;
+    return (0);
+}
+
+static unsigned char *put_varint(unsigned char *ptr, size_t u)
+{
+    while (u >= 0x80)
+    {
+        *ptr++ = (u & 0x7F) | 0x80;
+        u >>= 7;
+    }
+
+    *ptr++ = (unsigned char)u;
+    return (ptr);
+}
+
+static int get_varint(const unsigned char **ptr, const unsigned char *end, size_t *u)
+{
+    *u = 0;
+
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        if (*ptr >= end)
+            return (-1);
+
+        unsigned char byte = *(*ptr)++;
+
+        *u |= (size_t)(byte & 0x7F) << shift;
+
+        if (!(byte & 0x80))
+            return (0);
+    }
+
+    return (-1);
+}
+
+// Delta-codes the given raw block payload. Returns the size of the coded
+// stream, or zero if it doesn't fit in dstCapacity bytes.
+static size_t delta_encode(const unsigned char *src, uint32_t entryCount, unsigned char *dst, size_t dstCapacity)
+{
+    const unsigned char *prev = NULL;
+    size_t prevInSize = 0;
+    size_t prevOutSize = 0;
+    unsigned char *op = dst;
+    unsigned char *const oend = dst + dstCapacity;
+
+    for (uint32_t e = 0; e < entryCount; ++e)
+    {
+        size_t inSize = read_u32le(src);
+        size_t outSize = read_u32le(src + 4);
+        size_t size = inSize + outSize;
+        const unsigned char *data = src + 8;
+        const unsigned char *base = (prev != NULL && inSize == prevInSize && outSize == prevOutSize) ? prev : NULL;
+
+        if ((size_t)(oend - op) < 10)
+            return (0);
+
+        op = put_varint(op, inSize);
+        op = put_varint(op, outSize);
+
+        // Split the entry into runs of unchanged bytes followed by runs of
+        // changed bytes. Changed runs only stop at two unchanged bytes in a row,
+        // since a single one would cost more to encode than to copy.
+
+        size_t i = 0;
+
+        while (i < size)
+        {
+            size_t start = i;
+
+            while (i < size && data[i] == (base ? base[i] : 0))
+                ++i;
+
+            size_t diffStart = i;
+
+            while (i < size)
+            {
+                if (data[i] == (base ? base[i] : 0)
+                    && (i + 1 == size || data[i + 1] == (base ? base[i + 1] : 0)))
+                    break ;
+
+                ++i;
+            }
+
+            if ((size_t)(oend - op) < 10 + i - diffStart)
+                return (0);
+
+            op = put_varint(op, diffStart - start);
+            op = put_varint(op, i - diffStart);
+            memcpy(op, data + diffStart, i - diffStart);
+            op += i - diffStart;
+        }
+
+        prev = data;
+        prevInSize = inSize;
+        prevOutSize = outSize;
+        src = data + size;
+    }
+
+    return ((size_t)(op - dst));
+}
+
+// Rebuilds the raw block payload from a delta-coded stream. Returns zero if
+// successful, non-zero integer if the stream is malformed.
+static int delta_decode(const unsigned char *src, size_t srcSize, uint32_t entryCount, unsigned char *dst, size_t dstSize)
+{
+    const unsigned char *ip = src;
+    const unsigned char *const iend = src + srcSize;
+    const unsigned char *prev = NULL;
+    size_t prevInSize = 0;
+    size_t prevOutSize = 0;
+    unsigned char *op = dst;
+    unsigned char *const oend = dst + dstSize;
+
+    for (uint32_t e = 0; e < entryCount; ++e)
+    {
+        size_t inSize;
+        size_t outSize;
+
+        if (get_varint(&ip, iend, &inSize) || get_varint(&ip, iend, &outSize))
+            return (-1);
+
+        size_t size = inSize + outSize;
+
+        if ((size_t)(oend - op) < 8 || (size_t)(oend - op) - 8 < size)
+            return (-1);
+
+        const unsigned char *base = (prev != NULL && inSize == prevInSize && outSize == prevOutSize) ? prev : NULL;
+        unsigned char *data = op + 8;
+        size_t i = 0;
+
+        write_u32le(op, (uint32_t)inSize);
+        write_u32le(op + 4, (uint32_t)outSize);
+
+        while (i < size)
+        {
+            size_t sameCount;
+            size_t diffCount;
+
+            if (get_varint(&ip, iend, &sameCount) || get_varint(&ip, iend, &diffCount)
+                || sameCount + diffCount == 0 || size - i < sameCount
+                || size - i - sameCount < diffCount || (size_t)(iend - ip) < diffCount)
+                return (-1);
+
+            if (base != NULL)
+                memcpy(data + i, base + i, sameCount);
+            else
+                memset(data + i, 0, sameCount);
+
+            i += sameCount;
+            memcpy(data + i, ip, diffCount);
+            ip += diffCount;
+            i += diffCount;
+        }
+
+        prev = data;
+        prevInSize = inSize;
+        prevOutSize = outSize;
+        op = data + size;
+    }
+
+    return (ip == iend && op == oend ? 0 : -1);
+}
+
+static int dataset_writer_init(DatasetWriter *w, const char *filename, const char *mode)
+{
+    memset(w, 0, sizeof(DatasetWriter));
+    w->f = fopen(filename, mode);
+
+    if (w->f == NULL)
+    {
+        perror("dataset_writer_open(): unable to open file");
+        return (-1);
+    }
+
+    if (fseek(w->f, 0, SEEK_END) != 0)
+    {
+        perror("dataset_writer_open(): error");
+        goto open_fail;
+    }
+
+    // Write the file header if the file is new, otherwise check that we are
+    // appending to a dataset file of the same version.
+
+    if (ftell(w->f) == 0)
+    {
+        unsigned char header[DatasetHeaderSize] = {0};
+
+        memcpy(header, DATASET_MAGIC, 4);
+        write_u32le(header + 4, DatasetVersion);
+        w->versionFlags = DatasetKnownFlags;
+
+        if (fwrite(header, 1, DatasetHeaderSize, w->f) != DatasetHeaderSize)
+        {
+            perror("dataset_writer_open(): unable to write file header");
+            goto open_fail;
+        }
+    }
+    else
+    {
+        rewind(w->f);
+
+        if (dataset_check_header(w->f, "dataset_writer_open()", &w->versionFlags))
+            goto open_fail;
+
+        // An update stream needs a positioning call between a read and the
+        // next write, and this is also where new blocks belong anyway.
+
+        if (fseek(w->f, 0, SEEK_END) != 0)
+        {
+            perror("dataset_writer_open(): error");
+            goto open_fail;
+        }
+    }
+
+    if (dataset_grow_block(&w->block, &w->blockMaxSize, DatasetBlockSize))
+    {
+        perror("dataset_writer_open(): error");
+        goto open_fail;
+    }
+
+    // Leave room for the block header at the start of the buffer, so that each
+    // block can be written with a single call.
+
+    w->blockSize = DatasetBlockHeaderSize;
+    w->blockEntries = 0;
+    w->flags = (DatasetDeltaCoded | DatasetLzCompressed) & w->versionFlags;
+    return (0);
+
+open_fail:
+    fclose(w->f);
+    free(w->block);
+    memset(w, 0, sizeof(DatasetWriter));
+    return (-1);
+}
+
+int dataset_writer_open(DatasetWriter *w, const char *filename)
+{
+    return (dataset_writer_init(w, filename, "ab+"));
+}
+
+int dataset_writer_create(DatasetWriter *w, const char *filename)
+{
+    return (dataset_writer_init(w, filename, "wb+"));
+}
+
+void dataset_writer_set_flags(DatasetWriter *w, uint32_t flags)
+{
+    w->flags = flags & w->versionFlags;
+}
+
+int dataset_writer_append(DatasetWriter *w, const void *inData, const void *outData, size_t inSize, size_t outSize)
+{
+    size_t entrySize = 8 + inSize + outSize;
+
+    if (entrySize > DatasetMaxBlockSize - DatasetBlockHeaderSize)
+    {
+        fputs("dataset_writer_append(): error: entry too large\n", stderr);
+        return (-1);
+    }
+
+    if (w->blockEntries != 0 && w->blockSize + entrySize > DatasetBlockSize && dataset_writer_flush(w))
+        return (-1);
+
+    if (dataset_grow_block(&w->block, &w->blockMaxSize, w->blockSize + entrySize))
+    {
+        perror("dataset_writer_append(): error");
+        return (-1);
+    }
+
+    unsigned char *ptr = w->block + w->blockSize;
+
+    write_u32le(ptr, (uint32_t)inSize);
+    write_u32le(ptr + 4, (uint32_t)outSize);
+    memcpy(ptr + 8, inData, inSize);
+    memcpy(ptr + 8 + inSize, outData, outSize);
+    w->blockSize += entrySize;
+    w->blockEntries++;
+    return (0);
+}
+
+// Codes the pending block into the packed buffer, after the room reserved for
+// the block header. Returns the size of the coded payload, or zero if the
+// block should be stored uncompressed.
+static size_t dataset_writer_code_block(DatasetWriter *w, size_t payloadSize, uint32_t *flags)
+{
+    const unsigned char *stream = w->block + DatasetBlockHeaderSize;
+    size_t streamSize = payloadSize;
+
+    *flags = 0;
+
+    // Only keep the coded form if it is strictly smaller than the raw payload.
+
+    if (w->flags == 0 || payloadSize <= 9)
+        return (0);
+
+    size_t capacity = payloadSize - 9;
+
+    if (dataset_grow_block(&w->scratch, &w->scratchMaxSize, payloadSize)
+        || dataset_grow_block(&w->packed, &w->packedMaxSize, DatasetBlockHeaderSize + payloadSize))
+        return (0);
+
+    if ((w->flags & DatasetLzCompressed) && w->lz == NULL && (w->lz = malloc(sizeof(LzState))) == NULL)
+        return (0);
+
+    unsigned char *out = w->packed + DatasetBlockHeaderSize + 8;
+    size_t outSize = 0;
+
+    if (w->flags & DatasetDeltaCoded)
+    {
+        size_t deltaSize = delta_encode(stream, w->blockEntries, w->scratch, payloadSize);
+
+        if (deltaSize != 0)
+        {
+            stream = w->scratch;
+            streamSize = deltaSize;
+            *flags |= DatasetDeltaCoded;
+        }
+    }
+
+    if (w->flags & DatasetLzCompressed)
+        outSize = lz_compress(w->lz, stream, streamSize, out, capacity);
+
+    if (outSize != 0)
+        *flags |= DatasetLzCompressed;
+    else if (*flags != 0 && streamSize <= capacity)
+    {
+        memcpy(out, stream, streamSize);
+        outSize = streamSize;
+    }
+    else
+    {
+        *flags = 0;
+        return (0);
+    }
+
+    write_u32le(out - 8, (uint32_t)payloadSize);
+    write_u32le(out - 4, (uint32_t)streamSize);
+    return (outSize + 8);
+}
+
+int dataset_writer_flush(DatasetWriter *w)
+{
+    if (w->blockEntries == 0)
+        return (0);
+
+    uint32_t flags;
+    size_t payloadSize = w->blockSize - DatasetBlockHeaderSize;
+    size_t codedSize = dataset_writer_code_block(w, payloadSize, &flags);
+    unsigned char *block = w->block;
+
+    if (codedSize != 0)
+    {
+        block = w->packed;
+        payloadSize = codedSize;
+    }
+
+    write_u32le(block, w->blockEntries);
+    write_u32le(block + 4, (uint32_t)payloadSize);
+    write_u32le(block + 8, dataset_crc32(block + DatasetBlockHeaderSize, payloadSize));
+    write_u32le(block + 12, flags);
+
+    if (fwrite(block, 1, DatasetBlockHeaderSize + payloadSize, w->f) != DatasetBlockHeaderSize + payloadSize)
+    {
+        perror("dataset_writer_flush(): unable to write block to file");
+        return (-1);
+    }
+
+    w->blockSize = DatasetBlockHeaderSize;
+    w->blockEntries = 0;
+    return (0);
+}
+
+int dataset_writer_close(DatasetWriter *w)
+{
+    int ret = dataset_writer_flush(w);
+
+    if (fclose(w->f) != 0)
+    {
+        perror("dataset_writer_close(): error");
+        ret = -1;
+    }
+
+    free(w->block);
+    free(w->scratch);
+    free(w->packed);
+    free(w->lz);
+    memset(w, 0, sizeof(DatasetWriter));
+    return (ret);
+}
+
+int dataset_same_file(const char *filename1, const char *filename2)
+{
+    struct stat st1;
+    struct stat st2;
+
+    if (stat(filename1, &st1) != 0 || stat(filename2, &st2) != 0)
+        return (0);
+
+#if defined(_WIN32) || defined(_WIN64)
+    // Windows does not report inode numbers, so only compare the names.
+    return (strcmp(filename1, filename2) == 0);
+#else
+    return (st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino);
+#endif
+}
+
+int dataset_reader_open(DatasetReader *r, const char *filename)
+{
+    memset(r, 0, sizeof(DatasetReader));
+    r->f = fopen(filename, "rb");
+    r->threads = 1;
+
+    if (r->f == NULL)
+    {
+        perror("dataset_reader_open(): unable to open file");
+        return (-1);
+    }
+
+    if (dataset_check_header(r->f, "dataset_reader_open()", &r->versionFlags))
+    {
+        fclose(r->f);
+        r->f = NULL;
+        return (-1);
+    }
+
+    return (0);
+}
+
+static void dataset_reader_free_blocks(DatasetReader *r)
+{
+    if (r->blocks != NULL)
+        for (int i = 0; i < r->slotCount; ++i)
+        {
+            free(r->blocks[i].stored);
+            free(r->blocks[i].scratch);
+            free(r->blocks[i].data);
+        }
+
+    free(r->blocks);
+    r->blocks = NULL;
+    r->slotCount = 0;
+}
+
+// Tells the loaders to exit and waits for them. Blocks which have already been
+// loaded are dropped.
+static void dataset_reader_stop_loaders(DatasetReader *r)
+{
+    if (r->loaders == NULL)
+        return ;
+
+    pthread_mutex_lock(&r->mutex);
+    r->exit = 1;
+    pthread_cond_broadcast(&r->slotFreed);
+    pthread_mutex_unlock(&r->mutex);
+
+    for (int i = 0; i < r->loaderCount; ++i)
+        pthread_join(r->loaders[i], NULL);
+
+    pthread_mutex_destroy(&r->mutex);
+    pthread_cond_destroy(&r->slotFreed);
+    pthread_cond_destroy(&r->blockReady);
+    free(r->loaders);
+    r->loaders = NULL;
+    r->loaderCount = 0;
+}
+
+int dataset_reader_set_threads(DatasetReader *r, int threads)
+{
+    dataset_reader_stop_loaders(r);
+    dataset_reader_free_blocks(r);
+    r->threads = (threads < 1) ? 1 : threads;
+    return (dataset_reader_rewind(r));
+}
+
+// Reads the next block of the file in its stored form. Returns 1 if a block
+// was read, 0 at the end of the file, and a negative integer on errors.
+static int dataset_reader_read_block(DatasetReader *r, DatasetBlock *b)
+{
+    unsigned char header[DatasetBlockHeaderSize];
+    size_t headerSize = fread(header, 1, DatasetBlockHeaderSize, r->f);
+
+    if (headerSize == 0 && feof(r->f))
+        return (0);
+
+    if (headerSize != DatasetBlockHeaderSize)
+    {
+        fputs("dataset_reader_next(): error: truncated block header\n", stderr);
+        return (-1);
+    }
+
+    uint32_t payloadSize = read_u32le(header + 4);
+
+    b->entryCount = read_u32le(header);
+    b->crc = read_u32le(header + 8);
+    b->flags = read_u32le(header + 12);
+
+    if (payloadSize > DatasetMaxBlockSize || (b->flags & ~r->versionFlags)
+        || (b->flags != 0 && payloadSize < 8))
+    {
+        fputs("dataset_reader_next(): error: invalid block header\n", stderr);
+        return (-1);
+    }
+
+    if (dataset_grow_block(&b->stored, &b->storedMaxSize, payloadSize))
+    {
+        perror("dataset_reader_next(): error");
+        return (-2);
+    }
+
+    if (fread(b->stored, 1, payloadSize, r->f) != payloadSize)
+    {
+        fputs("dataset_reader_next(): error: truncated block\n", stderr);
+        return (-1);
+    }
+
+    b->storedSize = payloadSize;
+    return (1);
+}
+
+// Verifies the checksum of a stored block and decodes its payload. Sets the
+// block status to zero if successful, and to a negative integer on errors.
+static void dataset_block_decode(DatasetBlock *b)
+{
+    if (dataset_crc32(b->stored, b->storedSize) != b->crc)
+    {
+        fputs("dataset_reader_next(): error: block checksum mismatch\n", stderr);
+        b->status = -1;
+        return ;
+    }
+
+    if (b->flags == 0)
+    {
+        b->payload = b->stored;
+        b->payloadSize = b->storedSize;
+        b->status = 0;
+        return ;
+    }
+
+    size_t decodedSize = read_u32le(b->stored);
+    size_t streamSize = read_u32le(b->stored + 4);
+    const unsigned char *stream = b->stored + 8;
+
+    if (decodedSize > DatasetMaxBlockSize || streamSize > DatasetMaxBlockSize)
+        goto corrupted_block;
+
+    if (b->flags & DatasetLzCompressed)
+    {
+        if (dataset_grow_block(&b->scratch, &b->scratchMaxSize, streamSize))
+            goto alloc_fail;
+
+        if (lz_decompress(stream, b->storedSize - 8, b->scratch, streamSize))
+            goto corrupted_block;
+
+        stream = b->scratch;
+    }
+    else if (streamSize != b->storedSize - 8)
+        goto corrupted_block;
+
+    if (b->flags & DatasetDeltaCoded)
+    {
+        if (dataset_grow_block(&b->data, &b->dataMaxSize, decodedSize))
+            goto alloc_fail;
+
+        if (delta_decode(stream, streamSize, b->entryCount, b->data, decodedSize))
+            goto corrupted_block;
+
+        stream = b->data;
+    }
+    else if (streamSize != decodedSize)
+        goto corrupted_block;
+
+    b->payload = stream;
+    b->payloadSize = decodedSize;
+    b->status = 0;
+    return ;
+
+corrupted_block:
+    fputs("dataset_reader_next(): error: malformed block payload\n", stderr);
+    b->status = -1;
+    return ;
+
+alloc_fail:
+    perror("dataset_reader_next(): error");
+    b->status = -2;
+    return ;
+}
+
+// Loader thread entry point. Loaders take turns reading the next block of the
+// file into a free slot, so that disk reads stay sequential, and decode it
+// while the other loaders read the following blocks.
+static void *dataset_loader(void *ptr)
+{
+    DatasetReader *r = ptr;
+
+    pthread_mutex_lock(&r->mutex);
+
+    while (1)
+    {
+        while (!r->exit && !r->endOfFile && r->nextLoad - r->nextConsume >= (uint64_t)r->slotCount)
+            pthread_cond_wait(&r->slotFreed, &r->mutex);
+
+        if (r->exit || r->endOfFile)
+            break ;
+
+        DatasetBlock *b = r->blocks + r->nextLoad % (uint64_t)r->slotCount;
+        int ret = dataset_reader_read_block(r, b);
+
+        // Read errors are handed to the caller through the block slot, in
+        // place of the block which couldn't be read.
+
+        if (ret <= 0)
+        {
+            r->endOfFile = 1;
+
+            if (ret < 0)
+            {
+                b->status = ret;
+                b->ready = 1;
+                r->nextLoad++;
+            }
+
+            pthread_cond_broadcast(&r->blockReady);
+            break ;
+        }
+
+        r->nextLoad++;
+        pthread_mutex_unlock(&r->mutex);
+        dataset_block_decode(b);
+        pthread_mutex_lock(&r->mutex);
+        b->ready = 1;
+        pthread_cond_broadcast(&r->blockReady);
+    }
+
+    pthread_mutex_unlock(&r->mutex);
+    return (NULL);
+}
+
+// Allocates the block slots and starts the loaders. Each loader gets two slots,
+// so that it can decode a block while the caller still goes through the one it
+// decoded before. Returns zero if successful, non-zero integer otherwise.
+static int dataset_reader_start_loaders(DatasetReader *r)
+{
+    if (r->blocks == NULL)
+    {
+        r->blocks = calloc(2 * r->threads, sizeof(DatasetBlock));
+
+        if (r->blocks == NULL)
+        {
+            perror("dataset_reader_next(): error");
+            return (-2);
+        }
+
+        r->slotCount = 2 * r->threads;
+    }
+
+    r->loaders = malloc(sizeof(pthread_t) * r->threads);
+
+    if (r->loaders == NULL)
+    {
+        perror("dataset_reader_next(): error");
+        return (-2);
+    }
+
+    pthread_mutex_init(&r->mutex, NULL);
+    pthread_cond_init(&r->slotFreed, NULL);
+    pthread_cond_init(&r->blockReady, NULL);
+    r->exit = 0;
+
+    // Run with fewer loaders if some of them can't be created.
+
+    while (r->loaderCount < r->threads
+        && !pthread_create(&r->loaders[r->loaderCount], NULL, &dataset_loader, r))
+        r->loaderCount++;
+
+    if (r->loaderCount == 0)
+    {
+        perror("dataset_reader_next(): unable to start loader thread");
+        dataset_reader_stop_loaders(r);
+        return (-2);
+    }
+
+    return (0);
+}
+
+// Releases the block handed to the caller, and waits for the next one. Returns
+// 1 if a block is available, 0 at the end of the file, and a negative integer
+// on errors.
+static int dataset_reader_fill(DatasetReader *r)
+{
+    if (r->loaders == NULL && dataset_reader_start_loaders(r))
+        return (-2);
+
+    pthread_mutex_lock(&r->mutex);
+
+    if (r->holdingBlock)
+    {
+        r->blocks[r->nextConsume % (uint64_t)r->slotCount].ready = 0;
+        r->nextConsume++;
+        r->holdingBlock = 0;
+        pthread_cond_broadcast(&r->slotFreed);
+    }
+
+    DatasetBlock *b = r->blocks + r->nextConsume % (uint64_t)r->slotCount;
+
+    while (!b->ready && !(r->endOfFile && r->nextLoad == r->nextConsume))
+        pthread_cond_wait(&r->blockReady, &r->mutex);
+
+    int ready = b->ready;
+
+    pthread_mutex_unlock(&r->mutex);
+
+    if (!ready)
+        return (0);
+
+    // Failed blocks stay in their slot, so that all subsequent reads report
+    // the error as well.
+
+    if (b->status < 0)
+        return (b->status);
+
+    r->holdingBlock = 1;
+    r->cursor = 0;
+    r->remaining = b->entryCount;
+    return (1);
+}
+
+int dataset_reader_next(DatasetReader *r, DatasetView *view)
+{
+    while (r->remaining == 0)
+    {
+        int ret = dataset_reader_fill(r);
+
+        if (ret <= 0)
+            return (ret);
+    }
+
+    const DatasetBlock *b = r->blocks + r->nextConsume % (uint64_t)r->slotCount;
+
+    if (b->payloadSize - r->cursor < 8)
+        goto corrupted_entry;
+
+    const unsigned char *ptr = b->payload + r->cursor;
+    size_t inSize = read_u32le(ptr);
+    size_t outSize = read_u32le(ptr + 4);
+
+    if (b->payloadSize - r->cursor - 8 < inSize + outSize)
+        goto corrupted_entry;
+
+    view->inData = ptr + 8;
+    view->outData = ptr + 8 + inSize;
+    view->inSize = inSize;
+    view->outSize = outSize;
+    r->cursor += 8 + inSize + outSize;
+    r->remaining--;
+    return (1);
+
+corrupted_entry:
+    fputs("dataset_reader_next(): error: entry exceeds block bounds\n", stderr);
+    return (-1);
+}
+
+int dataset_reader_count(DatasetReader *r, uint64_t *entryCount)
+{
+    unsigned char header[DatasetBlockHeaderSize];
+
+    if (dataset_reader_rewind(r))
+        return (-1);
+
+    *entryCount = 0;
+
+    while (fread(header, 1, DatasetBlockHeaderSize, r->f) == DatasetBlockHeaderSize)
+    {
+        *entryCount += read_u32le(header);
+
+        if (fseek(r->f, (long)read_u32le(header + 4), SEEK_CUR) != 0)
+        {
+            perror("dataset_reader_count(): error");
+            return (-1);
+        }
+    }
+
+    return (dataset_reader_rewind(r));
+}
+
+int dataset_reader_rewind(DatasetReader *r)
+{
+    // The loaders share the file position, so they must be stopped first.
+    // They are started again on the next read.
+
+    dataset_reader_stop_loaders(r);
+
+    for (int i = 0; i < r->slotCount; ++i)
+        r->blocks[i].ready = 0;
+
+    r->nextLoad = 0;
+    r->nextConsume = 0;
+    r->holdingBlock = 0;
+    r->endOfFile = 0;
+    r->cursor = 0;
+    r->remaining = 0;
+
+    if (fseek(r->f, DatasetHeaderSize, SEEK_SET) != 0)
+    {
+        perror("dataset_reader_rewind(): error");
+        return (-1);
+    }
+
+    return (0);
+}
+
+void dataset_reader_close(DatasetReader *r)
+{
+    dataset_reader_stop_loaders(r);
+
+    if (r->f != NULL)
+        fclose(r->f);
+
+    dataset_reader_free_blocks(r);
+    memset(r, 0, sizeof(DatasetReader));
+}
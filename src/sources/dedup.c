@@ -0,0 +1,393 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dataset.h"
+#include "packed_board.h"
+#include "timeman.h"
+#include "uci.h"
+
+enum { DedupBatchSize = 1 << 20 };
+
+typedef struct dedup_filter_s
+{
+    int maxScore;
+    int minPieces;
+    int maxPieces;
+    bool skipCheck;
+    bool skipCapture;
+}
+dedup_filter_t;
+
+typedef struct dedup_entry_s
+{
+    packed_board_t board;
+    packed_label_t label;
+    hashkey_t key;
+    bool keep;
+}
+dedup_entry_t;
+
+// Open-addressing set of position keys, owned by a single shard.
+typedef struct key_set_s
+{
+    hashkey_t *keys;
+    size_t count;
+    size_t mask;
+}
+key_set_t;
+
+typedef struct dedup_shard_s
+{
+    key_set_t set;
+    dedup_entry_t *batch;
+    size_t batchSize;
+    const dedup_filter_t *filter;
+    int index;
+    int shardCount;
+    uint64_t filtered;
+    uint64_t duplicates;
+    bool failed;
+    pthread_t thread;
+}
+dedup_shard_t;
+
+static bool key_set_grow(key_set_t *set)
+{
+    size_t newSize = set->keys ? (set->mask + 1) * 2 : 4096;
+    hashkey_t *newKeys = calloc(newSize, sizeof(hashkey_t));
+
+    if (newKeys == NULL)
+        return (false);
+
+    for (size_t i = 0; set->keys && i <= set->mask; ++i)
+        if (set->keys[i])
+        {
+            size_t j = set->keys[i] & (newSize - 1);
+
+            while (newKeys[j])
+                j = (j + 1) & (newSize - 1);
+
+            newKeys[j] = set->keys[i];
+        }
+
+    free(set->keys);
+    set->keys = newKeys;
+    set->mask = newSize - 1;
+    return (true);
+}
+
+// Inserts the key in the set. Returns 1 if the key was not already present, 0
+// if it was, and -1 on allocation failures.
+static int key_set_insert(key_set_t *set, hashkey_t key)
+{
+    // Zero marks empty slots, so remap the (very unlikely) zero key.
+
+    if (key == 0)
+        key = 1;
+
+    if ((set->count + 1) * 2 > set->mask + 1 && !key_set_grow(set))
+        return (-1);
+
+    // Shards are selected by the high bits of the key, so the low bits give an
+    // independent index within the shard.
+
+    size_t i = key & set->mask;
+
+    while (set->keys[i])
+    {
+        if (set->keys[i] == key)
+            return (0);
+
+        i = (i + 1) & set->mask;
+    }
+
+    set->keys[i] = key;
+    set->count++;
+    return (1);
+}
+
+static bool dedup_filter_pass(const dedup_filter_t *filter, const dedup_entry_t *entry)
+{
+    int pieces = packed_board_piece_count(&entry->board);
+
+    if (abs(packed_label_score(&entry->label)) > filter->maxScore)
+        return (false);
+
+    if (pieces < filter->minPieces || pieces > filter->maxPieces)
+        return (false);
+
+    if (filter->skipCheck && packed_board_in_check(&entry->board))
+        return (false);
+
+    if (filter->skipCapture && packed_board_is_capture(&entry->board, packed_label_move(&entry->label)))
+        return (false);
+
+    return (true);
+}
+
+// First pass over the batch: each thread computes the keys and applies the
+// filters on a contiguous slice of entries.
+static void *dedup_filter_thread(void *ptr)
+{
+    dedup_shard_t *shard = ptr;
+    size_t start = shard->batchSize * shard->index / shard->shardCount;
+    size_t end = shard->batchSize * (shard->index + 1) / shard->shardCount;
+
+    for (size_t i = start; i < end; ++i)
+    {
+        dedup_entry_t *entry = shard->batch + i;
+
+        entry->key = packed_board_key(&entry->board);
+        entry->keep = dedup_filter_pass(shard->filter, entry);
+
+        if (!entry->keep)
+            shard->filtered++;
+    }
+
+    return (NULL);
+}
+
+// Second pass over the batch: each thread owns the keys of its shard, and
+// drops all entries whose key was already seen. Entries are scanned in file
+// order, so the first occurrence of each position is the one kept.
+static void *dedup_shard_thread(void *ptr)
+{
+    dedup_shard_t *shard = ptr;
+
+    for (size_t i = 0; i < shard->batchSize; ++i)
+    {
+        dedup_entry_t *entry = shard->batch + i;
+
+        if (!entry->keep || (int)mul_hi64(entry->key, shard->shardCount) != shard->index)
+            continue ;
+
+        int ret = key_set_insert(&shard->set, entry->key);
+
+        if (ret < 0)
+        {
+            shard->failed = true;
+            return (NULL);
+        }
+
+        if (ret == 0)
+        {
+            entry->keep = false;
+            shard->duplicates++;
+        }
+    }
+
+    return (NULL);
+}
+
+static void dedup_run_pass(dedup_shard_t *shards, int shardCount, void *(*routine)(void *))
+{
+    for (int i = 1; i < shardCount; ++i)
+        if (pthread_create(&shards[i].thread, NULL, routine, shards + i))
+        {
+            perror("Unable to create dedup thread");
+            exit(EXIT_FAILURE);
+        }
+
+    routine(shards);
+
+    for (int i = 1; i < shardCount; ++i)
+        pthread_join(shards[i].thread, NULL);
+}
+
+void uci_dedup(const char *args)
+{
+    dedup_filter_t filter = {32767, 0, 32, false, false};
+    char *copy = strdup(args ? args : "");
+    char *inputFile = strtok(copy, Delimiters);
+    char *outputFile = strtok(NULL, Delimiters);
+    char *token = strtok(NULL, Delimiters);
+    int shardCount = 1;
+
+    if (outputFile == NULL)
+    {
+        puts("info string Usage: dedup <input> <output> [threads <n>] [maxscore <s>]"
+            " [minpieces <n>] [maxpieces <n>] [nocheck] [nocapture]");
+        fflush(stdout);
+        free(copy);
+        return ;
+    }
+
+    if (dataset_same_file(inputFile, outputFile))
+    {
+        fprintf(stderr, "dedup: error: %s is both the input and the output\n", inputFile);
+        free(copy);
+        return ;
+    }
+
+    while (token)
+    {
+        if (strcmp(token, "threads") == 0)
+        {
+            token = strtok(NULL, Delimiters);
+            if (token)
+                shardCount = max(1, atoi(token));
+        }
+        else if (strcmp(token, "maxscore") == 0)
+        {
+            token = strtok(NULL, Delimiters);
+            if (token)
+                filter.maxScore = atoi(token);
+        }
+        else if (strcmp(token, "minpieces") == 0)
+        {
+            token = strtok(NULL, Delimiters);
+            if (token)
+                filter.minPieces = atoi(token);
+        }
+        else if (strcmp(token, "maxpieces") == 0)
+        {
+            token = strtok(NULL, Delimiters);
+            if (token)
+                filter.maxPieces = atoi(token);
+        }
+        else if (strcmp(token, "nocheck") == 0)
+            filter.skipCheck = true;
+
+        else if (strcmp(token, "nocapture") == 0)
+            filter.skipCapture = true;
+
+        token = strtok(NULL, Delimiters);
+    }
+
+    DatasetReader reader;
+    DatasetWriter writer;
+    dedup_entry_t *batch = malloc(sizeof(dedup_entry_t) * DedupBatchSize);
+    dedup_shard_t *shards = calloc(shardCount, sizeof(dedup_shard_t));
+    uint64_t readCount = 0;
+    uint64_t writeCount = 0;
+    int status = 0;
+
+    if (batch == NULL || shards == NULL)
+    {
+        perror("Unable to allocate dedup buffers");
+        exit(EXIT_FAILURE);
+    }
+
+    if (dataset_reader_open(&reader, inputFile))
+        goto reader_fail;
+
+    if (dataset_writer_create(&writer, outputFile))
+        goto writer_fail;
+
+    dataset_reader_set_threads(&reader, shardCount);
+
+    clock_t startTime = chess_clock();
+
+    while (status == 0)
+    {
+        DatasetView view;
+        size_t batchSize = 0;
+
+        while (batchSize < DedupBatchSize && (status = dataset_reader_next(&reader, &view)) == 1)
+        {
+            if (view.inSize != sizeof(packed_board_t) || view.outSize != sizeof(packed_label_t))
+            {
+                fprintf(stderr, "dedup: error: %s is not a position dataset\n", inputFile);
+                status = -1;
+                break ;
+            }
+
+            memcpy(&batch[batchSize].board, view.inData, sizeof(packed_board_t));
+            memcpy(&batch[batchSize].label, view.outData, sizeof(packed_label_t));
+            ++batchSize;
+        }
+
+        if (status < 0)
+            break ;
+
+        status = (status == 1) ? 0 : 1;
+        readCount += batchSize;
+
+        for (int i = 0; i < shardCount; ++i)
+        {
+            shards[i].batch = batch;
+            shards[i].batchSize = batchSize;
+            shards[i].filter = &filter;
+            shards[i].index = i;
+            shards[i].shardCount = shardCount;
+        }
+
+        dedup_run_pass(shards, shardCount, &dedup_filter_thread);
+        dedup_run_pass(shards, shardCount, &dedup_shard_thread);
+
+        for (int i = 0; i < shardCount; ++i)
+            if (shards[i].failed)
+            {
+                perror("Unable to grow dedup key set");
+                exit(EXIT_FAILURE);
+            }
+
+        // Write the remaining entries back in their original order.
+
+        for (size_t i = 0; i < batchSize && status >= 0; ++i)
+            if (batch[i].keep)
+            {
+                if (dataset_writer_append(&writer, &batch[i].board, &batch[i].label,
+                    sizeof(packed_board_t), sizeof(packed_label_t)))
+                    status = -1;
+
+                ++writeCount;
+            }
+    }
+
+    if (dataset_writer_close(&writer))
+        status = -1;
+
+    uint64_t filtered = 0;
+    uint64_t duplicates = 0;
+
+    for (int i = 0; i < shardCount; ++i)
+    {
+        filtered += shards[i].filtered;
+        duplicates += shards[i].duplicates;
+    }
+
+    clock_t elapsed = chess_clock() - startTime;
+
+    printf("Dedup report:\n");
+    printf("READ:       %" FMT_INFO "\n", (info_t)readCount);
+    printf("FILTERED:   %" FMT_INFO "\n", (info_t)filtered);
+    printf("DUPLICATES: %" FMT_INFO "\n", (info_t)duplicates);
+    printf("WRITTEN:    %" FMT_INFO "\n", (info_t)writeCount);
+    printf("TIME:       %" FMT_INFO " milliseconds\n", (info_t)elapsed);
+
+    if (status < 0)
+        printf("info string Dedup stopped early, %s might be incomplete\n", outputFile);
+
+    fflush(stdout);
+
+writer_fail:
+    dataset_reader_close(&reader);
+
+reader_fail:
+    for (int i = 0; i < shardCount; ++i)
+        free(shards[i].set.keys);
+
+    free(shards);
+    free(batch);
+    free(copy);
+}
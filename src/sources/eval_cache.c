@@ -0,0 +1,57 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eval_cache.h"
+
+void eval_cache_resize(eval_cache_t *cache, size_t mbsize)
+{
+    size_t entryCount = mbsize * 1024 * 1024 / sizeof(uint64_t);
+
+    free(cache->table);
+    cache->table = NULL;
+    cache->mask = 0;
+
+    if (entryCount == 0)
+        return ;
+
+    while (entryCount & (entryCount - 1))
+        entryCount &= entryCount - 1;
+
+    cache->table = malloc(entryCount * sizeof(uint64_t));
+
+    if (cache->table == NULL)
+    {
+        perror("Unable to allocate eval cache");
+        exit(EXIT_FAILURE);
+    }
+
+    cache->mask = entryCount - 1;
+    eval_cache_clear(cache);
+}
+
+void eval_cache_clear(eval_cache_t *cache)
+{
+    if (cache->table != NULL)
+        memset(cache->table, 0, (cache->mask + 1) * sizeof(uint64_t));
+
+    cache->probes = 0;
+    cache->hits = 0;
+}
@@ -24,6 +24,7 @@
 #include "network.h"
 #include "pawns.h"
 #include "types.h"
+#include "worker.h"
 
 bool is_kxk_endgame(const board_t *board, color_t us)
 {
@@ -95,6 +96,15 @@ score_t evaluate(const board_t *board)
     if (is_kxk_endgame(board, BLACK))
         return (eval_kxk(board, BLACK));
 
+    // Skip the network inference if the eval of the position is cached.
+
+    worker_t *worker = board->worker;
+    eval_cache_t *cache = (worker != NULL && worker->evalCache.table != NULL) ? &worker->evalCache : NULL;
+    score_t eval;
+
+    if (cache != NULL && eval_cache_probe(cache, board->stack->boardKey, &eval))
+        return (eval);
+
     extern Network NN;
 
     weight_t outputBuffer[736];
@@ -104,5 +114,10 @@ score_t evaluate(const board_t *board)
 
     nn_acc_compute(&NN, accCopy + (size_t)board->sideToMove * NN.layerSizes[1], outputBuffer);
 
-    return clamp((int64_t)outputBuffer[0] * 200 / WG_ONE, 1 - VICTORY, VICTORY - 1);
+    eval = clamp((int64_t)outputBuffer[0] * 200 / WG_ONE, 1 - VICTORY, VICTORY - 1);
+
+    if (cache != NULL)
+        eval_cache_store(cache, board->stack->boardKey, eval);
+
+    return (eval);
 }
@@ -0,0 +1,215 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "large_pages.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+# include <malloc.h>
+# include <windows.h>
+#elif defined(__linux__)
+# include <sys/mman.h>
+# ifndef MAP_HUGE_SHIFT
+#  define MAP_HUGE_SHIFT 26
+# endif
+# ifndef MAP_HUGE_1GB
+#  define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+# endif
+#endif
+
+static size_t round_to_large_pages(size_t size)
+{
+    return ((size + LargePageSize - 1) & ~(size_t)(LargePageSize - 1));
+}
+
+#ifdef __linux__
+
+void *large_pages_alloc(size_t size, page_kind_t *pageKind)
+{
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    const size_t gigabyte = (size_t)1 << 30;
+    size_t mapSize = round_to_large_pages(size);
+    void *ptr;
+    page_kind_t kind;
+
+    // Mappings are always rounded up to whole 2MB pages, so that the same
+    // length can be given back to munmap() whatever the kind of pages.
+
+    if (mapSize % gigabyte == 0
+        && (ptr = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0)) != MAP_FAILED)
+    {
+        kind = HUGE_PAGES_1GB;
+        goto alloc_done;
+    }
+
+    if ((ptr = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0)) != MAP_FAILED)
+    {
+        kind = HUGE_PAGES_2MB;
+        goto alloc_done;
+    }
+
+    // Fall back to regular pages, over-allocating so that the mapping can be
+    // trimmed to a 2MB boundary for transparent huge pages.
+
+    unsigned char *raw = mmap(NULL, mapSize + LargePageSize, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+    if (raw == MAP_FAILED)
+        return (NULL);
+
+    size_t head = (LargePageSize - (uintptr_t)raw % LargePageSize) % LargePageSize;
+
+    if (head)
+        munmap(raw, head);
+
+    munmap(raw + head + mapSize, LargePageSize - head);
+    ptr = raw + head;
+    kind = madvise(ptr, mapSize, MADV_HUGEPAGE) ? REGULAR_PAGES : TRANSPARENT_PAGES;
+
+alloc_done:
+    if (pageKind != NULL)
+        *pageKind = kind;
+
+    return (ptr);
+}
+
+void large_pages_free(void *ptr, size_t size)
+{
+    if (ptr != NULL)
+        munmap(ptr, round_to_large_pages(size));
+}
+
+#elif defined(_WIN32) || defined(_WIN64)
+
+// Large pages require the "Lock pages in memory" privilege, which must be
+// granted to the user account, and then enabled for the process.
+
+static bool enable_lock_memory_privilege(void)
+{
+    HANDLE token;
+    TOKEN_PRIVILEGES privileges;
+    bool enabled;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+        return (false);
+
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+
+    // AdjustTokenPrivileges() also succeeds when the account does not hold the
+    // privilege, in which case it sets the last error instead.
+
+    enabled = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid)
+        && AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL)
+        && GetLastError() == ERROR_SUCCESS;
+
+    CloseHandle(token);
+    return (enabled);
+}
+
+void *large_pages_alloc(size_t size, page_kind_t *pageKind)
+{
+    size_t largePageSize = GetLargePageMinimum();
+    void *ptr = NULL;
+    page_kind_t kind = REGULAR_PAGES;
+
+    // VirtualAlloc() returns zeroed memory, aligned on 64kB for regular pages
+    // and on the large page size otherwise. Large pages are 2MB on x86-64.
+
+    if (largePageSize && enable_lock_memory_privilege())
+    {
+        size_t allocSize = (size + largePageSize - 1) / largePageSize * largePageSize;
+
+        ptr = VirtualAlloc(NULL, allocSize, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        kind = HUGE_PAGES_2MB;
+    }
+
+    if (ptr == NULL)
+    {
+        ptr = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        kind = REGULAR_PAGES;
+    }
+
+    if (ptr != NULL && pageKind != NULL)
+        *pageKind = kind;
+
+    return (ptr);
+}
+
+void large_pages_free(void *ptr, size_t size __attribute__((unused)))
+{
+    if (ptr != NULL)
+        VirtualFree(ptr, 0, MEM_RELEASE);
+}
+
+#else
+
+void *large_pages_alloc(size_t size, page_kind_t *pageKind)
+{
+    size_t allocSize = round_to_large_pages(size);
+    void *ptr = aligned_malloc(LargePageSize, allocSize);
+
+    if (ptr != NULL)
+        memset(ptr, 0, allocSize);
+
+    if (pageKind != NULL)
+        *pageKind = REGULAR_PAGES;
+
+    return (ptr);
+}
+
+void large_pages_free(void *ptr, size_t size __attribute__((unused)))
+{
+    aligned_free(ptr);
+}
+
+#endif
+
+void *aligned_malloc(size_t alignment, size_t size)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    return (_aligned_malloc(size, alignment));
+#else
+    // aligned_alloc() requires the size to be a multiple of the alignment.
+
+    return (aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment));
+#endif
+}
+
+void aligned_free(void *ptr)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+const char *page_kind_name(page_kind_t pageKind)
+{
+    static const char *names[] = {
+        "regular pages",
+        "transparent huge pages",
+        "2MB huge pages",
+        "1GB huge pages"
+    };
+
+    return (names[pageKind]);
+}
@@ -0,0 +1,192 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+enum
+{
+    LzMinMatch = 4,
+    LzMaxOffset = 65535
+};
+
+static uint32_t lz_read32(const unsigned char *ptr)
+{
+    uint32_t value;
+
+    memcpy(&value, ptr, sizeof(uint32_t));
+    return (value);
+}
+
+static uint32_t lz_hash(uint32_t sequence)
+{
+    return ((sequence * 2654435761u) >> (32 - LzHashBits));
+}
+
+static unsigned char *lz_put_length(unsigned char *op, size_t length)
+{
+    while (length >= 255)
+    {
+        *op++ = 255;
+        length -= 255;
+    }
+
+    *op++ = (unsigned char)length;
+    return (op);
+}
+
+static int lz_get_length(const unsigned char **ip, const unsigned char *iend, size_t *length)
+{
+    unsigned char byte;
+
+    do {
+        if (*ip >= iend)
+            return (-1);
+
+        byte = *(*ip)++;
+        *length += byte;
+    } while (byte == 255);
+
+    return (0);
+}
+
+// Returns the worst-case size of a token holding the given literal count and
+// match length.
+static size_t lz_token_bound(size_t litLength, size_t matchLength)
+{
+    return (1 + litLength / 255 + 1 + litLength + 2 + matchLength / 255 + 1);
+}
+
+size_t lz_compress(LzState *state, const unsigned char *src, size_t srcSize, unsigned char *dst, size_t dstCapacity)
+{
+    // Positions are stored with a +1 bias, so that zero marks an empty slot.
+
+    uint32_t *const table = state->table;
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *const iend = src + srcSize;
+    unsigned char *op = dst;
+    unsigned char *const oend = dst + dstCapacity;
+
+    memset(state->table, 0, sizeof(state->table));
+
+    while (srcSize >= LzMinMatch && ip <= iend - LzMinMatch)
+    {
+        uint32_t sequence = lz_read32(ip);
+        uint32_t h = lz_hash(sequence);
+        uint32_t candidate = table[h];
+
+        table[h] = (uint32_t)(ip - src) + 1;
+
+        const unsigned char *ref = src + (candidate ? candidate - 1 : 0);
+
+        if (candidate == 0 || (size_t)(ip - ref) > LzMaxOffset || lz_read32(ref) != sequence)
+        {
+            ++ip;
+            continue ;
+        }
+
+        size_t matchLength = LzMinMatch;
+
+        while (ip + matchLength < iend && ref[matchLength] == ip[matchLength])
+            ++matchLength;
+
+        size_t litLength = (size_t)(ip - anchor);
+        size_t offset = (size_t)(ip - ref);
+
+        matchLength -= LzMinMatch;
+
+        if (lz_token_bound(litLength, matchLength) > (size_t)(oend - op))
+            return (0);
+
+        unsigned char *token = op++;
+
+        *token = (unsigned char)(((litLength < 15 ? litLength : 15) << 4) | (matchLength < 15 ? matchLength : 15));
+
+        if (litLength >= 15)
+            op = lz_put_length(op, litLength - 15);
+
+        memcpy(op, anchor, litLength);
+        op += litLength;
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+
+        if (matchLength >= 15)
+            op = lz_put_length(op, matchLength - 15);
+
+        ip += matchLength + LzMinMatch;
+        anchor = ip;
+    }
+
+    // Emit the remaining bytes as literals in a final token.
+
+    size_t litLength = (size_t)(iend - anchor);
+
+    if (lz_token_bound(litLength, 0) > (size_t)(oend - op))
+        return (0);
+
+    *op++ = (unsigned char)((litLength < 15 ? litLength : 15) << 4);
+
+    if (litLength >= 15)
+        op = lz_put_length(op, litLength - 15);
+
+    memcpy(op, anchor, litLength);
+    op += litLength;
+
+    return ((size_t)(op - dst));
+}
+
+int lz_decompress(const unsigned char *src, size_t srcSize, unsigned char *dst, size_t dstSize)
+{
+    const unsigned char *ip = src;
+    const unsigned char *const iend = src + srcSize;
+    unsigned char *op = dst;
+    unsigned char *const oend = dst + dstSize;
+
+    while (ip < iend)
+    {
+        unsigned char token = *ip++;
+        size_t litLength = token >> 4;
+
+        if (litLength == 15 && lz_get_length(&ip, iend, &litLength))
+            return (-1);
+
+        if ((size_t)(iend - ip) < litLength || (size_t)(oend - op) < litLength)
+            return (-1);
+
+        memcpy(op, ip, litLength);
+        op += litLength;
+        ip += litLength;
+
+        // The last token of the stream has no match part.
+
+        if (ip == iend)
+            break ;
+
+        if (iend - ip < 2)
+            return (-1);
+
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        size_t matchLength = token & 15;
+
+        ip += 2;
+
+        if (matchLength == 15 && lz_get_length(&ip, iend, &matchLength))
+            return (-1);
+
+        matchLength += LzMinMatch;
+
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < matchLength)
+            return (-1);
+
+        // Matches can overlap with the bytes they produce, so copy them one
+        // byte at a time.
+
+        const unsigned char *ref = op - offset;
+
+        for (size_t i = 0; i < matchLength; ++i)
+            op[i] = ref[i];
+
+        op += matchLength;
+    }
+
+    return (op == oend ? 0 : -1);
+}
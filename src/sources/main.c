@@ -36,7 +36,7 @@ movelist_t SearchMoves;
 uint64_t Seed = 1048592ul;
 
 ucioptions_t Options = {
-    1, 16, 100, 1, NULL, false, false
+    1, 16, 100, 1, 1, NULL, false, false, false
 };
 
 Network NN = {};
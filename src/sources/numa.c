@@ -0,0 +1,133 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "numa.h"
+
+#ifdef __linux__
+
+# include <sched.h>
+
+enum { MaxNumaNodes = 64 };
+
+static cpu_set_t NodeCpus[MaxNumaNodes];
+static int NodeCount = 1;
+static pthread_once_t NumaOnce = PTHREAD_ONCE_INIT;
+
+// Parses a CPU list like "0-15,32-47" into the given set. Returns the number
+// of CPUs found.
+static int parse_cpu_list(FILE *f, cpu_set_t *set)
+{
+    int count = 0;
+    int first;
+    int last;
+    char sep;
+
+    CPU_ZERO(set);
+
+    while (fscanf(f, "%d", &first) == 1)
+    {
+        last = first;
+
+        if (fscanf(f, "%c", &sep) == 1 && sep == '-')
+        {
+            if (fscanf(f, "%d", &last) != 1)
+                break ;
+
+            if (fscanf(f, "%c", &sep) != 1)
+                sep = '\n';
+        }
+
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+        {
+            CPU_SET(cpu, set);
+            ++count;
+        }
+
+        if (sep != ',')
+            break ;
+    }
+
+    return (count);
+}
+
+static void numa_init(void)
+{
+    int nodes = 0;
+
+    // Nodes are numbered contiguously in practice, so stop at the first
+    // missing one.
+
+    for (int i = 0; nodes < MaxNumaNodes; ++i)
+    {
+        char path[64];
+
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", i);
+
+        FILE *f = fopen(path, "r");
+
+        if (f == NULL)
+            break ;
+
+        int cpuCount = parse_cpu_list(f, &NodeCpus[nodes]);
+
+        fclose(f);
+
+        // Skip memory-only nodes, which have no CPU to run threads on.
+
+        if (cpuCount != 0)
+            ++nodes;
+    }
+
+    NodeCount = (nodes != 0) ? nodes : 1;
+}
+
+int numa_node_count(void)
+{
+    pthread_once(&NumaOnce, &numa_init);
+    return (NodeCount);
+}
+
+void numa_bind_thread(size_t idx)
+{
+    if (numa_node_count() <= 1)
+        return ;
+
+    // Binding is only a placement hint, so failures are silently ignored.
+
+    sched_setaffinity(0, sizeof(cpu_set_t), &NodeCpus[idx % NodeCount]);
+}
+
+#else
+
+int numa_node_count(void)
+{
+    return (1);
+}
+
+void numa_bind_thread(size_t idx __attribute__((unused)))
+{
+}
+
+#endif
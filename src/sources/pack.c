@@ -0,0 +1,149 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dataset.h"
+#include "option.h"
+#include "packed_board.h"
+#include "timeman.h"
+#include "uci.h"
+
+enum { PackMaxLineSize = 1024 };
+
+// Returns the game result given as the last token of the line, if any, and
+// cuts it from the line so that only the FEN remains.
+static int pack_parse_result(char *line)
+{
+    static const char *results[3] = {"0-1", "1/2-1/2", "1-0"};
+    char *last = strrchr(line, ' ');
+
+    if (last == NULL)
+        return (PACKED_NO_RESULT);
+
+    for (int result = PACKED_BLACK_WIN; result <= PACKED_WHITE_WIN; ++result)
+        if (strcmp(last + 1, results[result]) == 0)
+        {
+            *last = '\0';
+            return (result);
+        }
+
+    return (PACKED_NO_RESULT);
+}
+
+void uci_pack(const char *args)
+{
+    char *copy = strdup(args ? args : "");
+    char *inputFile = strtok(copy, Delimiters);
+    char *outputFile = strtok(NULL, Delimiters);
+
+    if (outputFile == NULL)
+    {
+        puts("info string Usage: pack <input> <output>");
+        fflush(stdout);
+        free(copy);
+        return ;
+    }
+
+    FILE *f = fopen(inputFile, "r");
+    DatasetWriter writer;
+    char line[PackMaxLineSize];
+    board_t board;
+    boardstack_t stack;
+    uint64_t writeCount = 0;
+    uint64_t skipped = 0;
+    int status = 0;
+
+    if (f == NULL)
+    {
+        perror("Unable to open pack input");
+        free(copy);
+        return ;
+    }
+
+    if (dataset_writer_create(&writer, outputFile))
+    {
+        fclose(f);
+        free(copy);
+        return ;
+    }
+
+    board.acc = NULL;
+
+    clock_t startTime = chess_clock();
+
+    // Each line holds a FEN, optionally followed by the game result. The
+    // entries get an empty score and move, to be filled by rescore.
+
+    while (status == 0 && fgets(line, sizeof(line), f) != NULL)
+    {
+        size_t length = strlen(line);
+
+        while (length && isspace((unsigned char)line[length - 1]))
+            line[--length] = '\0';
+
+        if (length == 0)
+            continue ;
+
+        int result = pack_parse_result(line);
+        packed_board_t pb;
+        packed_label_t label;
+
+        set_board(&board, line, Options.chess960, &stack);
+
+        if (popcount(occupancy_bb(&board)) > 32)
+        {
+            ++skipped;
+            continue ;
+        }
+
+        pack_board(&board, &pb);
+        packed_label_set(&label, 0, NO_MOVE, result);
+
+        if (dataset_writer_append(&writer, &pb, &label, sizeof(packed_board_t), sizeof(packed_label_t)))
+            status = -1;
+        else
+            ++writeCount;
+    }
+
+    if (ferror(f))
+    {
+        perror("Unable to read pack input");
+        status = -1;
+    }
+
+    if (dataset_writer_close(&writer))
+        status = -1;
+
+    clock_t elapsed = chess_clock() - startTime;
+
+    printf("Pack report:\n");
+    printf("WRITTEN:    %" FMT_INFO "\n", (info_t)writeCount);
+    printf("SKIPPED:    %" FMT_INFO "\n", (info_t)skipped);
+    printf("TIME:       %" FMT_INFO " milliseconds\n", (info_t)elapsed);
+
+    if (status < 0)
+        printf("info string Pack stopped early, %s might be incomplete\n", outputFile);
+
+    fflush(stdout);
+    free(board.acc);
+    fclose(f);
+    free(copy);
+}
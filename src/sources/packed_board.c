@@ -0,0 +1,223 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "packed_board.h"
+
+static bitboard_t packed_board_occupancy(const packed_board_t *pb)
+{
+    bitboard_t occupancy = 0;
+
+    for (int i = 0; i < 8; ++i)
+        occupancy |= (bitboard_t)pb->occupancy[i] << (8 * i);
+
+    return (occupancy);
+}
+
+// Unpacks the piece list of the record into a square-indexed table.
+static void packed_board_table(const packed_board_t *pb, piece_t table[SQUARE_NB])
+{
+    bitboard_t occupancy = packed_board_occupancy(pb);
+
+    for (square_t square = SQ_A1; square <= SQ_H8; ++square)
+        table[square] = NO_PIECE;
+
+    // Boards with more than 32 pieces cannot be packed, so clamp the index to
+    // avoid reading past the record on malformed occupancies.
+
+    for (int i = 0; occupancy && i < 32; ++i)
+    {
+        square_t square = bb_pop_first_sq(&occupancy);
+
+        table[square] = (pb->pieces[i / 2] >> (4 * (i & 1))) & 0xF;
+    }
+}
+
+void pack_board(const board_t *board, packed_board_t *pb)
+{
+    bitboard_t occupancy = occupancy_bb(board);
+    int castlings = board->stack->castlings;
+    int fullmove = 1 + (board->ply - (board->sideToMove == BLACK)) / 2;
+    int castlingFiles = 0;
+
+    memset(pb, 0, sizeof(packed_board_t));
+
+    for (int i = 0; i < 8; ++i)
+        pb->occupancy[i] = (occupancy >> (8 * i)) & 0xFF;
+
+    for (int i = 0; occupancy && i < 32; ++i)
+    {
+        square_t square = bb_pop_first_sq(&occupancy);
+
+        pb->pieces[i / 2] |= piece_on(board, square) << (4 * (i & 1));
+    }
+
+    for (int i = 0; i < 4; ++i)
+        if (castlings & (1 << i))
+            castlingFiles |= sq_file(board->castlingRookSquare[1 << i]) << (3 * i);
+
+    pb->sideToMove = board->sideToMove;
+    pb->castlings = castlings;
+    pb->enPassantSquare = board->stack->enPassantSquare;
+    pb->rule50 = min(board->stack->rule50, 255);
+    pb->fullmove[0] = fullmove & 0xFF;
+    pb->fullmove[1] = (fullmove >> 8) & 0xFF;
+    pb->castlingFiles[0] = castlingFiles & 0xFF;
+    pb->castlingFiles[1] = castlingFiles >> 8;
+}
+
+void unpack_board(const packed_board_t *pb, board_t *board, boardstack_t *stack, bool isChess960)
+{
+    const char *pieceToChar = " PNBRQK  pnbrqk";
+    piece_t table[SQUARE_NB];
+    char fen[128];
+    char *ptr = fen;
+    int castlingFiles = pb->castlingFiles[0] | (pb->castlingFiles[1] << 8);
+
+    // Go through a FEN string, so that the board gets set up exactly as with
+    // the position command.
+
+    packed_board_table(pb, table);
+
+    for (rank_t rank = RANK_8; rank >= RANK_1; --rank)
+    {
+        int emptyCount = 0;
+
+        for (file_t file = FILE_A; file <= FILE_H; ++file)
+        {
+            piece_t piece = table[create_sq(file, rank)];
+
+            if (piece == NO_PIECE)
+            {
+                ++emptyCount;
+                continue ;
+            }
+
+            if (emptyCount)
+                *(ptr++) = emptyCount + '0';
+
+            emptyCount = 0;
+            *(ptr++) = pieceToChar[piece];
+        }
+
+        if (emptyCount)
+            *(ptr++) = emptyCount + '0';
+
+        if (rank > RANK_1)
+            *(ptr++) = '/';
+    }
+
+    *(ptr++) = ' ';
+    *(ptr++) = pb->sideToMove == WHITE ? 'w' : 'b';
+    *(ptr++) = ' ';
+
+    // Castling rights are written with the rook files, which works for both
+    // standard chess and Chess960 positions.
+
+    for (int i = 0; i < 4; ++i)
+        if (pb->castlings & (1 << i))
+            *(ptr++) = (i < 2 ? 'A' : 'a') + ((castlingFiles >> (3 * i)) & 7);
+
+    if (!(pb->castlings & ANY_CASTLING))
+        *(ptr++) = '-';
+
+    *(ptr++) = ' ';
+
+    if (pb->enPassantSquare >= SQUARE_NB)
+        *(ptr++) = '-';
+    else
+    {
+        *(ptr++) = 'a' + sq_file(pb->enPassantSquare);
+        *(ptr++) = '1' + sq_rank(pb->enPassantSquare);
+    }
+
+    sprintf(ptr, " %d %d", pb->rule50, pb->fullmove[0] | (pb->fullmove[1] << 8));
+    set_board(board, fen, isChess960, stack);
+}
+
+hashkey_t packed_board_key(const packed_board_t *pb)
+{
+    piece_t table[SQUARE_NB];
+    hashkey_t key = 0;
+
+    packed_board_table(pb, table);
+
+    for (square_t square = SQ_A1; square <= SQ_H8; ++square)
+        if (table[square] != NO_PIECE)
+            key ^= ZobristPsq[table[square]][square];
+
+    if (pb->enPassantSquare < SQUARE_NB)
+        key ^= ZobristEnPassant[sq_file(pb->enPassantSquare)];
+
+    if (pb->sideToMove == BLACK)
+        key ^= ZobristBlackToMove;
+
+    return (key ^ ZobristCastling[pb->castlings & ANY_CASTLING]);
+}
+
+int packed_board_piece_count(const packed_board_t *pb)
+{
+    return (popcount(packed_board_occupancy(pb)));
+}
+
+bool packed_board_in_check(const packed_board_t *pb)
+{
+    piece_t table[SQUARE_NB];
+    bitboard_t occupancy = packed_board_occupancy(pb);
+    bitboard_t themBB[PIECETYPE_NB] = {0};
+    color_t us = pb->sideToMove ? BLACK : WHITE;
+    square_t kingSquare = SQ_NONE;
+
+    packed_board_table(pb, table);
+
+    for (square_t square = SQ_A1; square <= SQ_H8; ++square)
+    {
+        piece_t piece = table[square];
+
+        if (piece == NO_PIECE)
+            continue ;
+
+        if (piece == create_piece(us, KING))
+            kingSquare = square;
+        else if (piece_color(piece) != us)
+            themBB[piece_type(piece)] |= square_bb(square);
+    }
+
+    if (kingSquare == SQ_NONE)
+        return (false);
+
+    return ((pawn_moves(kingSquare, us) & themBB[PAWN])
+        || (knight_moves(kingSquare) & themBB[KNIGHT])
+        || (bishop_moves_bb(kingSquare, occupancy) & (themBB[BISHOP] | themBB[QUEEN]))
+        || (rook_moves_bb(kingSquare, occupancy) & (themBB[ROOK] | themBB[QUEEN])));
+}
+
+bool packed_board_is_capture(const packed_board_t *pb, move_t move)
+{
+    piece_t table[SQUARE_NB];
+
+    if (move == NO_MOVE || move_type(move) == CASTLING)
+        return (false);
+
+    if (move_type(move) == EN_PASSANT)
+        return (true);
+
+    packed_board_table(pb, table);
+    return (table[to_sq(move)] != NO_PIECE);
+}
@@ -0,0 +1,235 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "movelist.h"
+#include "perft.h"
+#include "timeman.h"
+#include "uci.h"
+
+// Subtree of the perft tree, reached by playing one or two moves from the
+// root position.
+typedef struct perft_task_s
+{
+    move_t moves[2];
+    size_t rootIndex;
+    uint64_t nodes;
+}
+perft_task_t;
+
+typedef struct perft_job_s
+{
+    perft_task_t *tasks;
+    size_t taskCount;
+    _Atomic size_t next;
+    int plies;
+    unsigned int depth;
+    perft_hash_t hash;
+}
+perft_job_t;
+
+static perft_job_t PerftJob;
+
+static uint64_t perft(board_t *board, unsigned int depth, perft_hash_t *hash)
+{
+    if (depth == 0)
+        return (1);
+
+    movelist_t list;
+    list_all(&list, board);
+
+    // Bulk counting: the perft number at depth 1 equals the number of legal moves.
+    // Large perft speedup from not having to do the make/unmake move stuff.
+
+    if (depth == 1)
+        return (movelist_size(&list));
+
+    hashkey_t key = perft_hash_key(board->stack->boardKey, depth);
+    perft_entry_t *entry = NULL;
+
+    if (hash->table != NULL)
+    {
+        entry = perft_hash_entry(hash, key);
+
+        uint64_t count = atomic_load_explicit(&entry->count, memory_order_relaxed);
+
+        if ((atomic_load_explicit(&entry->check, memory_order_relaxed) ^ count) == key)
+            return (count);
+    }
+
+    uint64_t sum = 0;
+    boardstack_t stack;
+
+    for (extmove_t *extmove = list.moves; extmove < list.last; ++extmove)
+    {
+        do_move(board, extmove->move, &stack);
+        sum += perft(board, depth - 1, hash);
+        undo_move(board, extmove->move);
+    }
+
+    if (entry != NULL)
+    {
+        atomic_store_explicit(&entry->count, sum, memory_order_relaxed);
+        atomic_store_explicit(&entry->check, key ^ sum, memory_order_relaxed);
+    }
+
+    return (sum);
+}
+
+static void perft_run_tasks(worker_t *worker)
+{
+    board_t *board = &worker->board;
+    size_t i;
+
+    // Subtree sizes vary a lot, so they're handed out one at a time, and
+    // the workers which finish early keep taking the remaining ones.
+
+    while ((i = atomic_fetch_add_explicit(&PerftJob.next, 1, memory_order_relaxed)) < PerftJob.taskCount)
+    {
+        perft_task_t *task = &PerftJob.tasks[i];
+        boardstack_t stacks[2];
+
+        for (int k = 0; k < PerftJob.plies; ++k)
+            do_move(board, task->moves[k], &stacks[k]);
+
+        task->nodes = perft(board, PerftJob.depth, &PerftJob.hash);
+
+        for (int k = PerftJob.plies - 1; k >= 0; --k)
+            undo_move(board, task->moves[k]);
+    }
+}
+
+// Splits the tree at the root moves for shallow perfts, and at their replies
+// otherwise, so that there are enough subtrees for balancing the work between
+// the workers.
+
+static void perft_split(worker_t *worker, unsigned int depth)
+{
+    board_t *board = &worker->board;
+    movelist_t list;
+    boardstack_t stack;
+    size_t taskCount = 0;
+
+    PerftJob.plies = (depth >= 3) ? 2 : 1;
+    PerftJob.depth = depth - (unsigned int)PerftJob.plies;
+
+    for (size_t i = 0; i < worker->rootCount; ++i)
+    {
+        if (PerftJob.plies == 1)
+        {
+            ++taskCount;
+            continue ;
+        }
+
+        do_move(board, worker->rootMoves[i].move, &stack);
+        list_all(&list, board);
+        undo_move(board, worker->rootMoves[i].move);
+        taskCount += movelist_size(&list);
+    }
+
+    PerftJob.tasks = malloc(sizeof(perft_task_t) * (taskCount + !taskCount));
+
+    if (PerftJob.tasks == NULL)
+    {
+        perror("Unable to allocate perft tasks");
+        exit(EXIT_FAILURE);
+    }
+
+    PerftJob.taskCount = 0;
+    PerftJob.next = 0;
+
+    for (size_t i = 0; i < worker->rootCount; ++i)
+    {
+        if (PerftJob.plies == 1)
+        {
+            PerftJob.tasks[PerftJob.taskCount++] = (perft_task_t){{worker->rootMoves[i].move, NO_MOVE}, i, 0};
+            continue ;
+        }
+
+        do_move(board, worker->rootMoves[i].move, &stack);
+        list_all(&list, board);
+        undo_move(board, worker->rootMoves[i].move);
+
+        for (const extmove_t *m = movelist_begin(&list); m < movelist_end(&list); ++m)
+            PerftJob.tasks[PerftJob.taskCount++] = (perft_task_t){{worker->rootMoves[i].move, m->move}, i, 0};
+    }
+}
+
+void worker_perft(worker_t *worker)
+{
+    if (worker->idx)
+    {
+        perft_run_tasks(worker);
+        return ;
+    }
+
+    const board_t *board = &worker->board;
+    unsigned int depth = (unsigned int)SearchParams.perft;
+    clock_t time = chess_clock();
+
+    PerftJob.hash.table = NULL;
+    PerftJob.hash.entryCount = (size_t)SearchParams.perftHash * 1024 * 1024 / sizeof(perft_entry_t);
+
+    if (PerftJob.hash.entryCount)
+    {
+        PerftJob.hash.table = calloc(PerftJob.hash.entryCount, sizeof(perft_entry_t));
+
+        if (PerftJob.hash.table == NULL)
+        {
+            perror("Unable to allocate perft hash");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    perft_split(worker, depth);
+    wpool_start_workers(&WPool);
+    perft_run_tasks(worker);
+    wpool_wait_search_end(&WPool);
+
+    time = chess_clock() - time;
+
+    uint64_t nodes = 0;
+    uint64_t *rootNodes = calloc(worker->rootCount + !worker->rootCount, sizeof(uint64_t));
+
+    if (rootNodes == NULL)
+    {
+        perror("Unable to allocate perft results");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < PerftJob.taskCount; ++i)
+        rootNodes[PerftJob.tasks[i].rootIndex] += PerftJob.tasks[i].nodes;
+
+    for (size_t i = 0; i < worker->rootCount; ++i)
+    {
+        printf("%s: %" FMT_INFO "\n", move_to_str(worker->rootMoves[i].move, board->chess960),
+            (info_t)rootNodes[i]);
+        nodes += rootNodes[i];
+    }
+
+    uint64_t nps = nodes / (time + !time) * 1000;
+
+    printf("info nodes %" FMT_INFO " nps %" FMT_INFO " time %" FMT_INFO "\n",
+        (info_t)nodes, (info_t)nps, (info_t)time);
+    fflush(stdout);
+
+    free(rootNodes);
+    free(PerftJob.tasks);
+    free(PerftJob.hash.table);
+}
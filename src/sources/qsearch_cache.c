@@ -0,0 +1,49 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qsearch_cache.h"
+
+void qsearch_cache_init(qsearch_cache_t *cache)
+{
+    if (cache->table == NULL)
+        cache->table = malloc(sizeof(qsearch_entry_t) * QsearchCacheSize);
+
+    if (cache->table == NULL)
+    {
+        perror("Unable to allocate qsearch cache");
+        exit(EXIT_FAILURE);
+    }
+
+    qsearch_cache_clear(cache);
+}
+
+void qsearch_cache_clear(qsearch_cache_t *cache)
+{
+    memset(cache->table, 0, sizeof(qsearch_entry_t) * QsearchCacheSize);
+    cache->probes = 0;
+    cache->hits = 0;
+}
+
+void qsearch_cache_free(qsearch_cache_t *cache)
+{
+    free(cache->table);
+    cache->table = NULL;
+}
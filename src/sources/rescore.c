@@ -0,0 +1,501 @@
+/*
+**    Vault, a UCI-compliant chess engine derivating from Stash
+**    Copyright (C) 2019-2022 Morgan Houppin
+**
+**    Vault is free software: you can redistribute it and/or modify
+**    it under the terms of the GNU General Public License as published by
+**    the Free Software Foundation, either version 3 of the License, or
+**    (at your option) any later version.
+**
+**    Vault is distributed in the hope that it will be useful,
+**    but WITHOUT ANY WARRANTY; without even the implied warranty of
+**    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**    GNU General Public License for more details.
+**
+**    You should have received a copy of the GNU General Public License
+**    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dataset.h"
+#include "engine.h"
+#include "large_pages.h"
+#include "movelist.h"
+#include "packed_board.h"
+#include "timeman.h"
+#include "tt.h"
+#include "uci.h"
+
+enum
+{
+    RescoreBatchSize = 4096,
+    RescoreDefaultHash = 16
+};
+
+typedef struct rescore_entry_s
+{
+    packed_board_t board;
+    packed_label_t label;
+    bool done;
+}
+rescore_entry_t;
+
+// Positions are numbered in file order, and go through two batch slots: the
+// command thread reads one batch and writes the previous one back while the
+// searchers work through the positions loaded so far. Position n lives in
+// slot (n / RescoreBatchSize) % 2.
+typedef struct rescore_job_s
+{
+    rescore_entry_t *slots[2];
+    size_t batchSizes[2];
+    size_t doneCounts[2];
+    uint64_t loaded;
+    uint64_t next;
+    bool endOfInput;
+    pthread_mutex_t mutex;
+    pthread_cond_t workAvailable;
+    pthread_cond_t batchDone;
+    int depth;
+    uint64_t nodes;
+}
+rescore_job_t;
+
+typedef struct rescore_searcher_s
+{
+    worker_t worker;
+    transposition_t tt;
+    boardstack_t rootStack;
+    root_move_t rootMoves[MaxRootMoves];
+    move_t rootPvs[MaxRootMoves][RootPvSize];
+    rescore_job_t *job;
+    uint64_t totalNodes;
+    pthread_t thread;
+}
+rescore_searcher_t;
+
+// Searches the position of the entry, and relabels it with the score and best
+// move found. Returns whether the entry got relabeled, which only fails if the
+// rescore is stopped before the first iteration completes.
+static bool rescore_entry(rescore_searcher_t *searcher, rescore_entry_t *entry)
+{
+    worker_t *worker = &searcher->worker;
+    board_t *board = &worker->board;
+    movelist_t list;
+
+    unpack_board(&entry->board, board, &searcher->rootStack, Options.chess960);
+    board->worker = worker;
+    list_all(&list, board);
+
+    // Each position is searched from empty tables, so that labels don't
+    // depend on which searcher got the position, or on what it searched before.
+
+    tt_table_discard(&searcher->tt);
+    qsearch_cache_clear(&worker->qsCache);
+    memset(worker->bfHistory, 0, sizeof(butterfly_history_t));
+    memset(worker->ctHistory, 0, sizeof(continuation_history_t));
+    memset(worker->cmHistory, 0, sizeof(countermove_history_t));
+    memset(worker->capHistory, 0, sizeof(capture_history_t));
+
+    worker_set_nodes(worker, 0);
+    worker->verifPlies = 0;
+    worker->rootCount = movelist_size(&list);
+
+    if (worker->rootCount == 0)
+    {
+        score_t score = board->stack->checkers ? mated_in(0) : 0;
+
+        packed_label_set(&entry->label, score, NO_MOVE, entry->label.result);
+        return (true);
+    }
+
+    for (size_t i = 0; i < worker->rootCount; ++i)
+    {
+        root_move_t *rootMove = &worker->rootMoves[i];
+
+        rootMove->move = list.moves[i].move;
+        rootMove->seldepth = 0;
+        rootMove->score = rootMove->prevScore = -INF_SCORE;
+        rootMove->pv[0] = rootMove->pv[1] = NO_MOVE;
+    }
+
+    // Plain iterative deepening with full windows. The node limit stops the
+    // search of this searcher only, but is ignored during the first iteration
+    // so that each entry gets a label.
+
+    int completedDepth = 0;
+
+    for (int iterDepth = 0; iterDepth < searcher->job->depth; ++iterDepth)
+    {
+        searchstack_t sstack[256];
+
+        memset(sstack, 0, sizeof(sstack));
+        worker->pvLine = 0;
+        worker->seldepth = 0;
+        worker->nodeLimit = (iterDepth == 0) ? UINT64_MAX : searcher->job->nodes;
+
+        search(board, iterDepth + 1, -INF_SCORE, INF_SCORE, &sstack[2], true);
+
+        // An aborted iteration only searched part of the root moves, so keep
+        // the results of the previous one.
+
+        if (worker_must_stop(worker))
+            break ;
+
+        sort_root_moves(worker->rootMoves, worker->rootMoves + worker->rootCount);
+
+        for (root_move_t *i = worker->rootMoves; i < worker->rootMoves + worker->rootCount; ++i)
+        {
+            i->prevScore = i->score;
+            i->score = -INF_SCORE;
+        }
+
+        completedDepth = iterDepth + 1;
+    }
+
+    searcher->totalNodes += worker_nodes(worker);
+
+    if (completedDepth == 0)
+        return (false);
+
+    packed_label_set(&entry->label, worker->rootMoves->prevScore,
+        worker->rootMoves->move, entry->label.result);
+    return (true);
+}
+
+static void *rescore_thread(void *ptr)
+{
+    rescore_searcher_t *searcher = ptr;
+    rescore_job_t *job = searcher->job;
+
+    // Positions are handed out one at a time, since search times vary a lot
+    // from one position to another. Once stopped, the remaining positions are
+    // still handed out, but skipped, so that their batches complete.
+
+    pthread_mutex_lock(&job->mutex);
+
+    while (true)
+    {
+        while (job->next >= job->loaded && !job->endOfInput)
+            pthread_cond_wait(&job->workAvailable, &job->mutex);
+
+        if (job->next >= job->loaded)
+            break ;
+
+        uint64_t n = job->next++;
+        int slot = (int)(n / RescoreBatchSize % 2);
+        rescore_entry_t *entry = job->slots[slot] + n % RescoreBatchSize;
+
+        pthread_mutex_unlock(&job->mutex);
+        entry->done = !WPool.stop && rescore_entry(searcher, entry);
+        pthread_mutex_lock(&job->mutex);
+
+        if (++job->doneCounts[slot] == job->batchSizes[slot])
+            pthread_cond_signal(&job->batchDone);
+    }
+
+    pthread_mutex_unlock(&job->mutex);
+    return (NULL);
+}
+
+// Reads the next batch of positions into the given slot. Returns the number of
+// positions read, and sets status to 1 at the end of the file, or to a negative
+// integer on errors.
+static size_t rescore_read_batch(DatasetReader *reader, rescore_entry_t *batch, const char *inputFile, int *status)
+{
+    DatasetView view;
+    size_t batchSize = 0;
+    int ret = 1;
+
+    while (batchSize < RescoreBatchSize && (ret = dataset_reader_next(reader, &view)) == 1)
+    {
+        if (view.inSize != sizeof(packed_board_t) || view.outSize != sizeof(packed_label_t))
+        {
+            fprintf(stderr, "rescore: error: %s is not a position dataset\n", inputFile);
+            *status = -1;
+            return (batchSize);
+        }
+
+        memcpy(&batch[batchSize].board, view.inData, sizeof(packed_board_t));
+        memcpy(&batch[batchSize].label, view.outData, sizeof(packed_label_t));
+        batch[batchSize].done = false;
+        batchSize++;
+    }
+
+    if (batchSize < RescoreBatchSize)
+        *status = (ret < 0) ? ret : 1;
+
+    return (batchSize);
+}
+
+void uci_rescore(const char *args)
+{
+    char *copy = strdup(args ? args : "");
+    char *inputFile = strtok(copy, Delimiters);
+    char *outputFile = strtok(NULL, Delimiters);
+    char *token = strtok(NULL, Delimiters);
+    int threads = 1;
+    size_t hashSize = RescoreDefaultHash;
+    rescore_job_t job;
+
+    memset(&job, 0, sizeof(job));
+
+    if (outputFile == NULL)
+    {
+        puts("info string Usage: rescore <input> <output> [threads <n>] [depth <d>] [nodes <n>] [hash <MB>]");
+        fflush(stdout);
+        free(copy);
+        return ;
+    }
+
+    if (dataset_same_file(inputFile, outputFile))
+    {
+        fprintf(stderr, "rescore: error: %s is both the input and the output\n", inputFile);
+        free(copy);
+        return ;
+    }
+
+    while (token)
+    {
+        if (strcmp(token, "threads") == 0)
+        {
+            token = strtok(NULL, Delimiters);
+            if (token)
+                threads = max(1, atoi(token));
+        }
+        else if (strcmp(token, "depth") == 0)
+        {
+            token = strtok(NULL, Delimiters);
+            if (token)
+                job.depth = atoi(token);
+        }
+        else if (strcmp(token, "nodes") == 0)
+        {
+            token = strtok(NULL, Delimiters);
+            if (token)
+                job.nodes = (uint64_t)atoll(token);
+        }
+        else if (strcmp(token, "hash") == 0)
+        {
+            token = strtok(NULL, Delimiters);
+            if (token)
+                hashSize = (size_t)max(1, atoi(token));
+        }
+
+        token = strtok(NULL, Delimiters);
+    }
+
+    // Default to a depth 8 search if no limit is given.
+
+    if (job.depth <= 0)
+        job.depth = job.nodes ? MAX_PLIES : 8;
+
+    job.depth = min(job.depth, MAX_PLIES);
+
+    if (job.nodes == 0)
+        --job.nodes;
+
+    DatasetReader reader;
+    DatasetWriter writer;
+    rescore_searcher_t **searchers = calloc(threads, sizeof(rescore_searcher_t *));
+    uint64_t entryCount = 0;
+    uint64_t skipped = 0;
+    int status = 0;
+
+    job.slots[0] = malloc(sizeof(rescore_entry_t) * RescoreBatchSize);
+    job.slots[1] = malloc(sizeof(rescore_entry_t) * RescoreBatchSize);
+
+    if (job.slots[0] == NULL || job.slots[1] == NULL || searchers == NULL)
+    {
+        perror("Unable to allocate rescore buffers");
+        exit(EXIT_FAILURE);
+    }
+
+    // Each searcher gets its own worker data and transposition table,
+    // independent from the pool. The searchers all use non-zero worker
+    // indexes, so that they never check the clock or print search info.
+
+    for (int i = 0; i < threads; ++i)
+    {
+        searchers[i] = aligned_malloc(_Alignof(rescore_searcher_t), sizeof(rescore_searcher_t));
+
+        if (searchers[i] != NULL)
+            memset(searchers[i], 0, sizeof(rescore_searcher_t));
+
+        if (searchers[i] == NULL
+            || (searchers[i]->worker.pawnTable = large_pages_alloc(PawnTableSize * sizeof(pawn_entry_t), NULL)) == NULL
+            || tt_table_alloc(&searchers[i]->tt, hashSize))
+        {
+            perror("Unable to allocate rescore searcher");
+            exit(EXIT_FAILURE);
+        }
+
+        eval_cache_resize(&searchers[i]->worker.evalCache, (size_t)Options.evalCache);
+        qsearch_cache_init(&searchers[i]->worker.qsCache);
+        searchers[i]->worker.idx = (size_t)i + 1;
+        searchers[i]->worker.tt = &searchers[i]->tt;
+        searchers[i]->worker.rootMoves = searchers[i]->rootMoves;
+
+        for (size_t k = 0; k < MaxRootMoves; ++k)
+            searchers[i]->rootMoves[k].pv = searchers[i]->rootPvs[k];
+        searchers[i]->job = &job;
+    }
+
+    if (dataset_reader_open(&reader, inputFile))
+        goto reader_fail;
+
+    if (dataset_writer_create(&writer, outputFile))
+        goto writer_fail;
+
+    // A stop command aborts the searchers through the pool's stop flag, so
+    // make sure that no other search is running.
+
+    worker_wait_search_end(wpool_main_worker(&WPool));
+    WPool.stop = false;
+
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.workAvailable, NULL);
+    pthread_cond_init(&job.batchDone, NULL);
+
+    clock_t startTime = chess_clock();
+
+    for (int i = 0; i < threads; ++i)
+        if (pthread_create(&searchers[i]->thread, &WorkerSettings, &rescore_thread, searchers[i]))
+        {
+            perror("Unable to create rescore thread");
+            exit(EXIT_FAILURE);
+        }
+
+    // Batch numbers of the next batch to read, and of the next one to write.
+
+    uint64_t readBatch = 0;
+    uint64_t writeBatch = 0;
+
+    while (true)
+    {
+        // Read ahead as long as a slot is free.
+
+        if (status == 0 && !WPool.stop && readBatch - writeBatch < 2)
+        {
+            int slot = (int)(readBatch % 2);
+            size_t batchSize = rescore_read_batch(&reader, job.slots[slot], inputFile, &status);
+
+            pthread_mutex_lock(&job.mutex);
+            job.batchSizes[slot] = batchSize;
+            job.doneCounts[slot] = 0;
+            job.loaded += batchSize;
+            job.endOfInput = (status != 0);
+            pthread_cond_broadcast(&job.workAvailable);
+            pthread_mutex_unlock(&job.mutex);
+
+            readBatch += (batchSize != 0);
+            continue ;
+        }
+
+        if (writeBatch == readBatch)
+            break ;
+
+        int slot = (int)(writeBatch % 2);
+        rescore_entry_t *batch = job.slots[slot];
+
+        pthread_mutex_lock(&job.mutex);
+
+        // Nothing more gets read once stopped, so let the searchers run out of
+        // positions.
+
+        if (WPool.stop && !job.endOfInput)
+        {
+            job.endOfInput = true;
+            pthread_cond_broadcast(&job.workAvailable);
+        }
+
+        while (job.doneCounts[slot] < job.batchSizes[slot])
+            pthread_cond_wait(&job.batchDone, &job.mutex);
+
+        pthread_mutex_unlock(&job.mutex);
+
+        // Write the relabeled entries in their original order. If the rescore
+        // got stopped, the entries which haven't been fully searched are
+        // dropped instead of keeping a meaningless label.
+
+        for (size_t i = 0; i < job.batchSizes[slot] && status >= 0; ++i)
+        {
+            if (!batch[i].done)
+            {
+                ++skipped;
+                continue ;
+            }
+
+            if (dataset_writer_append(&writer, &batch[i].board, &batch[i].label,
+                sizeof(packed_board_t), sizeof(packed_label_t)))
+                status = -1;
+            else
+                ++entryCount;
+        }
+
+        ++writeBatch;
+    }
+
+    // Release the searchers if reading ended on an error or a stop.
+
+    pthread_mutex_lock(&job.mutex);
+    job.endOfInput = true;
+    pthread_cond_broadcast(&job.workAvailable);
+    pthread_mutex_unlock(&job.mutex);
+
+    for (int i = 0; i < threads; ++i)
+        pthread_join(searchers[i]->thread, NULL);
+
+    if (WPool.stop && status >= 0)
+        status = -2;
+
+    WPool.stop = true;
+    pthread_mutex_destroy(&job.mutex);
+    pthread_cond_destroy(&job.workAvailable);
+    pthread_cond_destroy(&job.batchDone);
+
+    if (dataset_writer_close(&writer))
+        status = -1;
+
+    uint64_t totalNodes = 0;
+
+    for (int i = 0; i < threads; ++i)
+        totalNodes += searchers[i]->totalNodes;
+
+    clock_t elapsed = chess_clock() - startTime;
+
+    printf("Rescore report:\n");
+    printf("POSITIONS: %" FMT_INFO "\n", (info_t)entryCount);
+    printf("NODES:     %" FMT_INFO "\n", (info_t)totalNodes);
+    printf("TIME:      %" FMT_INFO " milliseconds\n", (info_t)elapsed);
+    printf("NPS:       %" FMT_INFO "\n", (info_t)(totalNodes * 1000 / (elapsed + !elapsed)));
+
+    if (status == -2)
+        printf("info string Rescore stopped, %" FMT_INFO " unfinished positions dropped,"
+            " the rest of %s was not processed\n", (info_t)skipped, inputFile);
+    else if (status < 0)
+        printf("info string Rescore stopped early, %s might be incomplete\n", outputFile);
+
+    fflush(stdout);
+
+writer_fail:
+    dataset_reader_close(&reader);
+
+reader_fail:
+    for (int i = 0; i < threads; ++i)
+    {
+        free(searchers[i]->worker.board.acc);
+        tt_table_free(&searchers[i]->tt);
+        large_pages_free(searchers[i]->worker.pawnTable, PawnTableSize * sizeof(pawn_entry_t));
+        eval_cache_resize(&searchers[i]->worker.evalCache, 0);
+        qsearch_cache_free(&searchers[i]->worker.qsCache);
+        aligned_free(searchers[i]);
+    }
+
+    free(searchers);
+    free(job.slots[0]);
+    free(job.slots[1]);
+    free(copy);
+}
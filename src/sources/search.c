@@ -19,6 +19,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "abdada.h"
 #include "board.h"
 #include "engine.h"
 #include "movepick.h"
@@ -28,6 +29,15 @@
 #include "uci.h"
 
 int Reductions[64][64];
+
+// Skip-blocks for helper workers: the helper with index i skips the
+// iterations for which ((depth + SkipPhase[i]) / SkipSize[i]) is odd, so that
+// helpers spread over several depths instead of duplicating the work of the
+// main worker.
+enum { SkipCount = 20 };
+
+const int SkipSize[SkipCount]  = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4};
+const int SkipPhase[SkipCount] = {0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7};
 int Pruning[2][7];
 
 void init_reduction_table(void)
@@ -43,33 +53,6 @@ void init_reduction_table(void)
     }
 }
 
-uint64_t perft(board_t *board, unsigned int depth)
-{
-    if (depth == 0)
-        return (1);
-
-    movelist_t list;
-    list_all(&list, board);
-
-    // Bulk counting: the perft number at depth 1 equals the number of legal moves.
-    // Large perft speedup from not having to do the make/unmake move stuff.
-
-    if (depth == 1)
-        return (movelist_size(&list));
-
-    uint64_t sum = 0;
-    boardstack_t stack;
-
-    for (extmove_t *extmove = list.moves; extmove < list.last; ++extmove)
-    {
-        do_move(board, extmove->move, &stack);
-        sum += perft(board, depth - 1);
-        undo_move(board, extmove->move);
-    }
-
-    return (sum);
-}
-
 void update_pv(move_t *pv, move_t bestmove, move_t *subPv)
 {
     size_t i;
@@ -85,21 +68,6 @@ void main_worker_search(worker_t *worker)
 {
     board_t *board = &worker->board;
 
-    if (SearchParams.perft)
-    {
-        clock_t time = chess_clock();
-        uint64_t nodes = perft(board, (unsigned int)SearchParams.perft);
-
-        time = chess_clock() - time;
-
-        uint64_t nps = nodes / (time + !time) * 1000;
-
-        printf("info nodes %" FMT_INFO " nps %" FMT_INFO " time %" FMT_INFO "\n",
-            (info_t)nodes, (info_t)nps, (info_t)time);
-
-        return ;
-    }
-
     if (worker->rootCount == 0)
     {
         printf("info depth 0 score %s 0\n", (board->stack->checkers) ? "mate" : "cp");
@@ -127,8 +95,7 @@ void main_worker_search(worker_t *worker)
     // before the GUI sends us the "stop" in infinite mode
     // or "ponderhit" in ponder mode.
 
-    while (!WPool.stop && (WPool.ponder || SearchParams.infinite))
-        ;
+    wpool_wait_release(&WPool);
 
     WPool.stop = true;
 
@@ -136,8 +103,6 @@ void main_worker_search(worker_t *worker)
     {
         puts("bestmove 0000");
         fflush(stdout);
-        free(worker->rootMoves);
-        free_boardstack(worker->stack);
         return ;
     }
 
@@ -145,9 +110,21 @@ void main_worker_search(worker_t *worker)
 
     wpool_wait_search_end(&WPool);
 
-    printf("bestmove %s", move_to_str(worker->rootMoves->move, board->chess960));
+    worker_t *bestWorker = (WPool.size > 1 && Options.multiPv == 1) ? select_best_worker(&WPool) : worker;
 
-    move_t ponderMove = worker->rootMoves->pv[1];
+    // Send the PV of the selected worker if it differs from the last one
+    // printed.
+
+    if (bestWorker != worker)
+    {
+        print_pv(board, bestWorker->rootMoves, 1, bestWorker->completedDepth,
+            chess_clock() - Timeman.start, EXACT_BOUND);
+        fflush(stdout);
+    }
+
+    printf("bestmove %s", move_to_str(bestWorker->rootMoves->move, board->chess960));
+
+    move_t ponderMove = bestWorker->rootMoves->pv[1];
 
     // If we finished searching with a fail-high, try to see if we can get a ponder
     // move in TT.
@@ -155,18 +132,18 @@ void main_worker_search(worker_t *worker)
     if (ponderMove == NO_MOVE)
     {
         boardstack_t stack;
-        tt_entry_t *entry;
+        tt_data_t ttData;
         bool found;
 
-        do_move(board, worker->rootMoves->move, &stack);
-        entry = tt_probe(board->stack->boardKey, &found);
-        undo_move(board, worker->rootMoves->move);
+        do_move(board, bestWorker->rootMoves->move, &stack);
+        tt_probe(worker->tt, &worker->ttStats, board->stack->boardKey, &found, &ttData);
+        undo_move(board, bestWorker->rootMoves->move);
 
         if (found)
         {
-            ponderMove = entry->bestmove;
+            ponderMove = ttData.bestmove;
 
-            // Take care of data races !
+            // The entry might come from a key collision, so check the move.
 
             if (!move_is_pseudo_legal(board, ponderMove) || !move_is_legal(board, ponderMove))
                 ponderMove = NO_MOVE;
@@ -178,21 +155,70 @@ void main_worker_search(worker_t *worker)
 
     putchar('\n');
     fflush(stdout);
+}
+
+// Selects the worker whose best move gets the most votes. Each worker votes
+// for its own best move, with a weight growing with its completed depth and
+// with the score of the move compared to the other workers' moves. Workers
+// stop updating their root moves once the search is over, so this doesn't
+// need any synchronization.
+
+worker_t *select_best_worker(worker_pool_t *wpool)
+{
+    worker_t *bestWorker = wpool_main_worker(wpool);
+    int64_t bestVotes = -1;
+    score_t minScore = INF_SCORE;
+
+    for (size_t i = 0; i < wpool->size; ++i)
+    {
+        const worker_t *cur = wpool->workerList[i];
+
+        if (cur->completedDepth && cur->rootMoves->prevScore != -INF_SCORE)
+            minScore = min(minScore, cur->rootMoves->prevScore);
+    }
+
+    for (size_t i = 0; i < wpool->size; ++i)
+    {
+        worker_t *cur = wpool->workerList[i];
+        int64_t votes = 0;
+
+        if (!cur->completedDepth || cur->rootMoves->prevScore == -INF_SCORE)
+            continue ;
+
+        for (size_t j = 0; j < wpool->size; ++j)
+        {
+            const worker_t *voter = wpool->workerList[j];
+
+            if (voter->completedDepth && voter->rootMoves->prevScore != -INF_SCORE
+                && voter->rootMoves->move == cur->rootMoves->move)
+                votes += (int64_t)(voter->rootMoves->prevScore - minScore + 14) * voter->completedDepth;
+        }
+
+        // Always prefer the shortest mate found, ignoring the votes.
 
-    free(worker->rootMoves);
-    free_boardstack(worker->stack);
+        if (bestVotes != -1 && bestWorker->rootMoves->prevScore >= MATE_FOUND)
+        {
+            if (cur->rootMoves->prevScore > bestWorker->rootMoves->prevScore)
+                bestWorker = cur;
+        }
+        else if (votes > bestVotes || cur->rootMoves->prevScore >= MATE_FOUND)
+        {
+            bestWorker = cur;
+            bestVotes = votes;
+        }
+    }
+
+    return (bestWorker);
 }
 
 void worker_search(worker_t *worker)
 {
     board_t *board = &worker->board;
 
-    // Reset all history related stuff.
+    // Histories are only cleared on "ucinewgame", so that the statistics from
+    // the previous moves of the game still help ordering the first iterations.
 
-    memset(worker->bfHistory, 0, sizeof(butterfly_history_t));
-    memset(worker->ctHistory, 0, sizeof(continuation_history_t));
-    memset(worker->cmHistory, 0, sizeof(countermove_history_t));
-    memset(worker->capHistory, 0, sizeof(capture_history_t));
+    worker_age_histories(worker);
     worker->verifPlies = 0;
 
     // Clamp MultiPV to the maximal number of lines available
@@ -204,6 +230,17 @@ void worker_search(worker_t *worker)
         bool hasSearchAborted;
         searchstack_t sstack[256];
 
+        // Never skip the last iteration, since helpers keep searching it until
+        // the main worker finishes.
+
+        if (worker->idx && iterDepth < SearchParams.depth - 1)
+        {
+            const int i = (int)((worker->idx - 1) % SkipCount);
+
+            if (((iterDepth + 1 + SkipPhase[i]) / SkipSize[i]) % 2)
+                continue ;
+        }
+
         // Reset the search stack data
 
         memset(sstack, 0, sizeof(sstack));
@@ -306,6 +343,8 @@ __retry:
         if (hasSearchAborted)
             break ;
 
+        worker->completedDepth = iterDepth + 1;
+
         // If we went over optimal time usage, we just finished our iteration,
         // so we can safely return our bestmove.
 
@@ -328,12 +367,6 @@ __retry:
         if (worker->idx && iterDepth == SearchParams.depth - 1)
             --iterDepth;
     }
-
-    if (worker->idx)
-    {
-        free(worker->rootMoves);
-        free_boardstack(worker->stack);
-    }
 }
 
 score_t search(board_t *board, int depth, score_t alpha, score_t beta, searchstack_t *ss, bool pvNode)
@@ -361,7 +394,7 @@ score_t search(board_t *board, int depth, score_t alpha, score_t beta, searchsta
     if (pvNode && worker->seldepth < ss->plies + 1)
         worker->seldepth = ss->plies + 1;
 
-    if (WPool.stop || game_is_drawn(board, ss->plies))
+    if (worker_must_stop(worker) || game_is_drawn(board, ss->plies))
         return (draw_score(worker));
 
     if (ss->plies >= MAX_PLIES)
@@ -388,16 +421,22 @@ score_t search(board_t *board, int depth, score_t alpha, score_t beta, searchsta
     score_t ttScore = NO_SCORE;
     move_t ttMove = NO_MOVE;
     bool found;
-    hashkey_t key = board->stack->boardKey ^ ((hashkey_t)ss->excludedMove << 16);
-    tt_entry_t *entry = tt_probe(key, &found);
+    hashkey_t key = board->stack->boardKey ^ (hashkey_t)ss->excludedMove;
+    tt_data_t ttData;
+    tt_entry_t entry = tt_probe(worker->tt, &worker->ttStats, key, &found, &ttData);
     score_t eval;
 
     if (found)
     {
-        ttScore = score_from_tt(entry->score, ss->plies);
-        ttBound = entry->genbound & 3;
-        ttDepth = entry->depth;
-        ttMove = entry->bestmove;
+        ttScore = score_from_tt(ttData.score, ss->plies);
+        ttBound = ttData.genbound & 3;
+        ttDepth = ttData.depth;
+        ttMove = ttData.bestmove;
+
+        // A move which can't be played here reveals a key collision.
+
+        if (ttMove && !move_is_pseudo_legal(board, ttMove))
+            tt_stat_add(&worker->ttStats.collisions, 1);
 
         if (ttDepth >= depth && !pvNode)
             if (((ttBound & LOWER_BOUND) && ttScore >= beta) || ((ttBound & UPPER_BOUND) && ttScore <= alpha))
@@ -420,20 +459,14 @@ score_t search(board_t *board, int depth, score_t alpha, score_t beta, searchsta
     }
     else if (found)
     {
-        eval = ss->staticEval = entry->eval;
+        eval = ss->staticEval = ttData.eval;
 
         if (ttBound & (ttScore > eval ? LOWER_BOUND : UPPER_BOUND))
             eval = ttScore;
     }
     else
-    {
         eval = ss->staticEval = evaluate(board);
 
-        // Save the eval in TT so that other workers won't have to recompute it.
-
-        tt_save(entry, key, NO_SCORE, eval, 0, NO_BOUND, NO_MOVE);
-    }
-
     if (rootNode && worker->pvLine)
         ttMove = worker->rootMoves[worker->pvLine].move;
 
@@ -512,8 +545,15 @@ __main_loop:
     move_t captures[64];
     int ccount = 0;
     bool skipQuiets = false;
+    move_t deferred[64];
+    int deferredCount = 0;
+    int deferredIdx = 0;
+    const bool abdadaNode = Options.abdada && WPool.size > 1 && !rootNode && depth >= AbdadaMinDepth;
 
-    while ((currmove = movepick_next_move(&mp, skipQuiets)) != NO_MOVE)
+    // Once the move picker is exhausted, search the moves deferred by ABDADA.
+
+    while ((currmove = movepick_next_move(&mp, skipQuiets)) != NO_MOVE
+        || (deferredIdx < deferredCount && (currmove = deferred[deferredIdx++]) != NO_MOVE))
     {
         if (rootNode)
         {
@@ -529,10 +569,25 @@ __main_loop:
                 continue ;
         }
 
-        moveCount++;
-
         bool isQuiet = !is_capture_or_promotion(board, currmove);
 
+        if (deferredIdx == 0)
+        {
+            // ABDADA: once the first move has been searched, defer moves whose
+            // subtree is currently searched by another worker.
+
+            if (abdadaNode && moveCount > 0 && deferredCount < 64
+                && abdada_is_busy(board_key_after(board, currmove), depth))
+            {
+                deferred[deferredCount++] = currmove;
+                continue ;
+            }
+        }
+        else if (skipQuiets && isQuiet)
+            continue ;
+
+        moveCount++;
+
         if (!rootNode && bestScore > -MATE_FOUND)
         {
             // Late Move Pruning.
@@ -597,6 +652,9 @@ __main_loop:
 
         do_move_gc(board, currmove, &stack, givesCheck);
 
+        const hashkey_t childKey = board->stack->boardKey;
+        const bool abdadaMarked = abdadaNode && abdada_enter(childKey, depth);
+
         // Can we apply LMR ?
 
         if (depth >= 3 && moveCount > 2 + 2 * rootNode)
@@ -641,7 +699,11 @@ __main_loop:
         }
 
         undo_move(board, currmove);
-        if (WPool.stop)
+
+        if (abdadaMarked)
+            abdada_leave(childKey);
+
+        if (worker_must_stop(worker))
             return (0);
 
         if (rootNode)
@@ -699,7 +761,7 @@ __main_loop:
     {
         int bound = (bestScore >= beta) ? LOWER_BOUND : (pvNode && bestmove) ? EXACT_BOUND : UPPER_BOUND;
 
-        tt_save(entry, key, score_to_tt(bestScore, ss->plies), ss->staticEval, depth, bound, bestmove);
+        tt_save(worker->tt, &worker->ttStats, entry, key, score_to_tt(bestScore, ss->plies), ss->staticEval, depth, bound, bestmove);
     }
 
     return (bestScore);
@@ -718,7 +780,7 @@ score_t qsearch(board_t *board, score_t alpha, score_t beta, searchstack_t *ss,
     if (pvNode && worker->seldepth < ss->plies + 1)
         worker->seldepth = ss->plies + 1;
 
-    if (WPool.stop || game_is_drawn(board, ss->plies))
+    if (worker_must_stop(worker) || game_is_drawn(board, ss->plies))
         return (draw_score(worker));
 
     if (ss->plies >= MAX_PLIES)
@@ -732,17 +794,23 @@ score_t qsearch(board_t *board, score_t alpha, score_t beta, searchstack_t *ss,
     if (alpha >= beta)
         return (alpha);
 
-    // Check for interesting TT values
+    // Check for interesting TT values. Results from the main search are in the
+    // TT, while our own results are kept in the qsearch cache.
 
     score_t ttScore = NO_SCORE;
     int ttBound = NO_BOUND;
     bool found;
-    tt_entry_t *entry = tt_probe(board->stack->boardKey, &found);
+    tt_data_t ttData;
+
+    tt_probe(worker->tt, &worker->ttStats, board->stack->boardKey, &found, &ttData);
+
+    if (!found)
+        found = qsearch_cache_probe(&worker->qsCache, board->stack->boardKey, &ttData);
 
     if (found)
     {
-        ttBound = entry->genbound & 3;
-        ttScore = score_from_tt(entry->score, ss->plies);
+        ttBound = ttData.genbound & 3;
+        ttScore = score_from_tt(ttData.score, ss->plies);
 
         if (!pvNode && (((ttBound & LOWER_BOUND) && ttScore >= beta)
             || ((ttBound & UPPER_BOUND) && ttScore <= alpha)))
@@ -762,7 +830,7 @@ score_t qsearch(board_t *board, score_t alpha, score_t beta, searchstack_t *ss,
     {
         if (found)
         {
-            eval = bestScore = entry->eval;
+            eval = bestScore = ttData.eval;
 
             if (ttBound & (ttScore > eval ? LOWER_BOUND : UPPER_BOUND))
                 eval = bestScore = ttScore;
@@ -778,7 +846,7 @@ score_t qsearch(board_t *board, score_t alpha, score_t beta, searchstack_t *ss,
             return (alpha);
     }
 
-    move_t ttMove = entry->bestmove;
+    move_t ttMove = found ? ttData.bestmove : NO_MOVE;
 
     (ss + 1)->plies = ss->plies + 1;
 
@@ -835,7 +903,7 @@ score_t qsearch(board_t *board, score_t alpha, score_t beta, searchstack_t *ss,
         score_t score = -qsearch(board, -beta, -alpha, ss + 1, pvNode);
         undo_move(board, currmove);
 
-        if (WPool.stop)
+        if (worker_must_stop(worker))
             return (0);
 
         if (bestScore < score)
@@ -860,7 +928,7 @@ score_t qsearch(board_t *board, score_t alpha, score_t beta, searchstack_t *ss,
 
     int bound = (bestScore >= beta) ? LOWER_BOUND : (bestScore <= oldAlpha) ? UPPER_BOUND : EXACT_BOUND;
 
-    tt_save(entry, board->stack->boardKey, score_to_tt(bestScore, ss->plies), eval, 0, bound, bestmove);
+    qsearch_cache_store(&worker->qsCache, board->stack->boardKey, score_to_tt(bestScore, ss->plies), eval, bound, bestmove);
 
     return (bestScore);
 }
@@ -26,10 +26,6 @@ NN_Worker;
 
 typedef struct _NN_Allocator
 {
-    size_t maxInputSize;
-    size_t maxOutputSize;
-    char *tempInputDecoder;
-    char *tempOutputDecoder;
     weight_t *batchInputMemory;
     weight_t *batchOutputMemory;
 }
@@ -170,18 +166,10 @@ int nn_train(Network *nn, Dataset *d, const char *datafile, TrainParams tp, uint
         return (-1);
     }
 
-    FILE *f = NULL;
+    DatasetReader reader = {};
 
-    if (datafile != NULL)
-    {
-        f = fopen(datafile, "rb");
-
-        if (f == NULL)
-        {
-            perror("nn_train(): error");
-            return (-1);
-        }
-    }
+    if (datafile != NULL && dataset_reader_open(&reader, datafile))
+        return (-1);
 
     int ret = 0;
 
@@ -259,36 +247,20 @@ int nn_train(Network *nn, Dataset *d, const char *datafile, TrainParams tp, uint
 
     size_t datasetSize = d->entryCount;
 
-    if (f != NULL)
+    if (reader.f != NULL)
     {
-        size_t inSize, outSize;
-        while (fread(&inSize, sizeof(size_t), 1, f) == 1)
-        {
-            if (fread(&outSize, sizeof(size_t), 1, f) != 1
-                || fseek(f, (long)(inSize + outSize), SEEK_CUR) != 0)
-            {
-                perror("nn_train(): error");
-                ret = -1;
-                goto nn_allocator_or_file_fail;
-            }
-            ++datasetSize;
+        uint64_t fileEntries;
 
-            alloc.maxInputSize = (inSize > alloc.maxInputSize) ? inSize : alloc.maxInputSize;
-            alloc.maxOutputSize = (outSize > alloc.maxOutputSize) ? outSize : alloc.maxOutputSize;
-        }
-    }
-
-    alloc.tempInputDecoder = malloc(alloc.maxInputSize * sizeof(weight_t));
-    alloc.tempOutputDecoder = malloc(alloc.maxOutputSize * sizeof(weight_t));
+        // Decode the file blocks with as many threads as used for training.
 
-    if (alloc.tempInputDecoder == NULL || alloc.tempOutputDecoder == NULL)
-    {
-        perror("nn_train(): error");
-        ret = -2;
-        free(alloc.tempInputDecoder);
-        free(alloc.tempOutputDecoder);
+        if (dataset_reader_set_threads(&reader, tp.threads)
+            || dataset_reader_count(&reader, &fileEntries))
+        {
+            ret = -1;
+            goto nn_allocator_or_file_fail;
+        }
 
-        goto nn_allocator_or_file_fail;
+        datasetSize += (size_t)fileEntries;
     }
 
     size_t batchCount = (datasetSize - 1) / tp.batchSize + 1;
@@ -315,8 +287,11 @@ int nn_train(Network *nn, Dataset *d, const char *datafile, TrainParams tp, uint
 
     for (int epoch = 0; epoch < tp.epochs; ++epoch)
     {
-        if (f != NULL)
-            rewind(f);
+        if (reader.f != NULL && dataset_reader_rewind(&reader))
+        {
+            ret = -1;
+            goto in_loop_fail;
+        }
 
         if (debug & TRAIN_SHOW_EPOCH)
         {
@@ -344,33 +319,34 @@ int nn_train(Network *nn, Dataset *d, const char *datafile, TrainParams tp, uint
             {
                 batchFill = (batchEnd <= d->entryCount) ? tp.batchSize : d->entryCount - batchStart;
 
-                if (d->decode)
-                    for (size_t i = 0; i < batchFill; ++i)
-                        d->decode(d->entries + batchStart + i, alloc.batchInputMemory + i * nnInputSize, alloc.batchOutputMemory + i * nnOutputSize);
-                else
-                    for (size_t i = 0; i < batchFill; ++i)
+                for (size_t i = 0; i < batchFill; ++i)
+                {
+                    DatasetView view = dataset_entry_view(d, batchStart + i);
+
+                    if (d->decode)
+                        d->decode(&view, alloc.batchInputMemory + i * nnInputSize, alloc.batchOutputMemory + i * nnOutputSize);
+                    else
                     {
-                        memcpy(alloc.batchInputMemory  + i * nnInputSize,  d->entries[batchStart + i].inData,  nnInputSize  * sizeof(weight_t));
-                        memcpy(alloc.batchOutputMemory + i * nnOutputSize, d->entries[batchStart + i].outData, nnOutputSize * sizeof(weight_t));
+                        memcpy(alloc.batchInputMemory  + i * nnInputSize,  view.inData,  nnInputSize  * sizeof(weight_t));
+                        memcpy(alloc.batchOutputMemory + i * nnOutputSize, view.outData, nnOutputSize * sizeof(weight_t));
                     }
+                }
             }
 
-            if (batchFill < tp.batchSize && f)
+            if (batchFill < tp.batchSize && reader.f != NULL)
                 while (batchFill < tp.batchSize)
                 {
-                    DatasetEntry tmp;
-
-                    tmp.inData  = alloc.tempInputDecoder;
-                    tmp.outData = alloc.tempOutputDecoder;
+                    DatasetView tmp;
+                    int readStatus = dataset_reader_next(&reader, &tmp);
 
-                    if (fread(&tmp.inSize, sizeof(size_t), 1, f) != 1)
+                    if (readStatus == 0)
                         break ;
 
-                    if (fread(&tmp.outSize, sizeof(size_t), 1, f) != 1
-                        || fread(tmp.inData, 1, tmp.inSize, f) != tmp.inSize
-                        || fread(tmp.outData, 1, tmp.outSize, f) != tmp.outSize)
+                    if (readStatus < 0 || (d->decode == NULL && (tmp.inSize != nnInputSize * sizeof(weight_t)
+                        || tmp.outSize != nnOutputSize * sizeof(weight_t))))
                     {
                         fputs("nn_train(): error: dataset file corrupted\n", stderr);
+                        ret = -1;
                         goto in_loop_fail;
                     }
 
@@ -445,15 +421,15 @@ int nn_train(Network *nn, Dataset *d, const char *datafile, TrainParams tp, uint
 
             for (size_t i = 0; i < d->entryCount; ++i)
             {
-                DatasetEntry *cur = d->entries + i;
+                DatasetView cur = dataset_entry_view(d, i);
 
                 if (d->decode == NULL)
                 {
-                    memcpy(workerList->entryInput, cur->inData, nnInputSize * sizeof(weight_t));
-                    memcpy(alloc.batchOutputMemory, cur->outData, nnOutputSize * sizeof(weight_t));
+                    memcpy(workerList->entryInput, cur.inData, nnInputSize * sizeof(weight_t));
+                    memcpy(alloc.batchOutputMemory, cur.outData, nnOutputSize * sizeof(weight_t));
                 }
                 else
-                    d->decode(cur, workerList->entryInput, alloc.batchOutputMemory);
+                    d->decode(&cur, workerList->entryInput, alloc.batchOutputMemory);
 
                 nn_compute(nn, workerList->entryInput, workerList->cpuBuffer);
                 for (size_t o = 0; o < nnOutputSize; ++o)
@@ -505,6 +481,6 @@ initial_alloc_fail:
     free(workerList);
     free(mGrad);
     free(vGrad);
-    if (f != NULL) fclose(f);
+    if (reader.f != NULL) dataset_reader_close(&reader);
     return (ret);
 }
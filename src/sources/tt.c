@@ -16,18 +16,21 @@
 **    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "numa.h"
 #include "tt.h"
 #include "uci.h"
 
 transposition_t TT = {
-    0, NULL, 0
+    0, NULL, 0, 0, REGULAR_PAGES
 };
 
 typedef struct tt_thread_s
 {
+    size_t idx;
     size_t start;
     size_t end;
     pthread_t thread;
@@ -37,13 +40,13 @@ tt_thread_t;
 void *tt_bzero_thread(void *data)
 {
     tt_thread_t *threadData = data;
-    const tt_entry_t zeroEntry = {
-        0, NO_SCORE, NO_SCORE, 0, 0, NO_MOVE
-    };
 
-    for (size_t i = threadData->start; i < threadData->end; ++i)
-        for (size_t j = 0; j < ClusterSize; ++j)
-            TT.table[i].clEntry[j] = zeroEntry;
+    // Zero the slice from a thread bound to the node the slice should live on,
+    // so that first-touch page placement spreads the table over all nodes.
+
+    numa_bind_thread(threadData->idx);
+
+    memset(TT.table + threadData->start, 0, (threadData->end - threadData->start) * sizeof(cluster_t));
 
     return (NULL);
 }
@@ -56,6 +59,15 @@ void tt_bzero(size_t threadCount)
         exit(EXIT_FAILURE);
     }
 
+    // Use at least one thread per node, and never zero from the calling
+    // thread on NUMA systems, since that would leave it bound to a node.
+
+    const size_t nodeCount = (size_t)numa_node_count();
+    const size_t firstThread = (nodeCount > 1) ? 0 : 1;
+
+    if (threadCount < nodeCount)
+        threadCount = nodeCount;
+
     tt_thread_t *threadList = malloc(sizeof(tt_thread_t) * threadCount);
 
     if (threadList == NULL)
@@ -66,43 +78,44 @@ void tt_bzero(size_t threadCount)
 
     for (size_t i = 0; i < threadCount; ++i)
     {
+        threadList[i].idx = i;
         threadList[i].start = TT.clusterCount * i / threadCount;
         threadList[i].end = TT.clusterCount * (i + 1) / threadCount;
     }
 
-    for (size_t i = 1; i < threadCount; ++i)
+    for (size_t i = firstThread; i < threadCount; ++i)
         if (pthread_create(&threadList[i].thread, NULL, &tt_bzero_thread, &threadList[i]))
         {
             perror("Unable to zero TT");
             exit(EXIT_FAILURE);
         }
 
-    tt_bzero_thread(&threadList[0]);
+    if (firstThread)
+        tt_bzero_thread(&threadList[0]);
 
-    for (size_t i = 1; i < threadCount; ++i)
+    for (size_t i = firstThread; i < threadCount; ++i)
         pthread_join(threadList[i].thread, NULL);
 
     free(threadList);
 }
 
-int tt_hashfull(void)
+void tt_discard(void)
 {
-    int count = 0;
+    // Clusters of the new epoch could be left over from 65536 discards ago,
+    // so zero the table before they can come back.
 
-    for (int i = 0; i < 1000; ++i)
-        for (int j = 0; j < ClusterSize; ++j)
-            count += (TT.table[i].clEntry[j].genbound & 0xFC) == TT.generation;
+    if (++TT.epoch == 0)
+        tt_bzero((size_t)Options.threads);
 
-    return (count / ClusterSize);
+    tt_clear();
 }
 
 void tt_resize(size_t mbsize)
 {
-    if (TT.table)
-        free(TT.table);
+    large_pages_free(TT.table, TT.clusterCount * sizeof(cluster_t));
 
     TT.clusterCount = mbsize * 1024 * 1024 / sizeof(cluster_t);
-    TT.table = malloc(TT.clusterCount * sizeof(cluster_t));
+    TT.table = large_pages_alloc(TT.clusterCount * sizeof(cluster_t), &TT.pageKind);
 
     if (TT.table == NULL)
     {
@@ -110,45 +123,348 @@ void tt_resize(size_t mbsize)
         exit(EXIT_FAILURE);
     }
 
-    tt_bzero((size_t)Options.threads);
+    // The table comes from fresh zero pages, which only get committed when
+    // first touched, so it doesn't need zeroing. On NUMA systems, still touch
+    // them from threads bound to each node: otherwise each page would land on
+    // the node of the first worker reaching it, instead of being spread over
+    // all nodes.
+
+    if (numa_node_count() > 1)
+        tt_bzero((size_t)Options.threads);
+}
+
+// TT dump file structure: header, followed by the raw table clusters. The
+// clusters are stored in native byte order, so the header records a byte
+// order mark to reject files written on incompatible systems.
+typedef struct tt_file_header_s
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t clusterBytes;
+    uint32_t byteOrder;
+    uint64_t clusterCount;
+    uint8_t generation;
+    uint8_t reserved;
+    uint16_t epoch;
+    uint32_t reserved2;
+}
+tt_file_header_t;
+
+enum
+{
+    TTFileVersion = 2,
+    TTFileByteOrder = 0x01020304,
+    TTFileChunkSize = 1 << 24
+};
+
+int tt_write_file(const char *filename)
+{
+    FILE *f = fopen(filename, "wb");
+
+    if (f == NULL)
+    {
+        perror("Unable to open TT file");
+        return (-1);
+    }
+
+    tt_file_header_t header = {
+        {'V', 'T', 'T', 'F'}, TTFileVersion, sizeof(cluster_t), TTFileByteOrder,
+        TT.clusterCount, TT.generation, 0, TT.epoch, 0
+    };
+    const unsigned char *ptr = (const unsigned char *)TT.table;
+    size_t remaining = TT.clusterCount * sizeof(cluster_t);
+
+    if (fwrite(&header, sizeof(header), 1, f) != 1)
+        goto write_fail;
+
+    // Write the table in large sequential chunks.
+
+    while (remaining)
+    {
+        size_t chunkSize = remaining < TTFileChunkSize ? remaining : TTFileChunkSize;
+
+        if (fwrite(ptr, 1, chunkSize, f) != chunkSize)
+            goto write_fail;
+
+        ptr += chunkSize;
+        remaining -= chunkSize;
+    }
+
+    if (fclose(f))
+    {
+        perror("Unable to write TT file");
+        return (-1);
+    }
+
+    return (0);
+
+write_fail:
+    perror("Unable to write TT file");
+    fclose(f);
+    return (-1);
+}
+
+// Seeks to an absolute offset, which can exceed the range of long on systems
+// where it only has 32 bits.
+static int tt_file_seek(FILE *f, uint64_t offset)
+{
+#if defined(_WIN32) || defined(_WIN64)
+    return (_fseeki64(f, (__int64)offset, SEEK_SET));
+#else
+    return (fseeko(f, (off_t)offset, SEEK_SET));
+#endif
+}
+
+typedef struct tt_read_thread_s
+{
+    const char *filename;
+    size_t start;
+    size_t end;
+    bool failed;
+    pthread_t thread;
+}
+tt_read_thread_t;
+
+void *tt_read_thread(void *data)
+{
+    tt_read_thread_t *threadData = data;
+    FILE *f = fopen(threadData->filename, "rb");
+    unsigned char *ptr = (unsigned char *)(TT.table + threadData->start);
+    size_t remaining = (threadData->end - threadData->start) * sizeof(cluster_t);
+
+    threadData->failed = (f == NULL
+        || tt_file_seek(f, sizeof(tt_file_header_t) + (uint64_t)threadData->start * sizeof(cluster_t)));
+
+    while (!threadData->failed && remaining)
+    {
+        size_t chunkSize = remaining < TTFileChunkSize ? remaining : TTFileChunkSize;
+
+        threadData->failed = (fread(ptr, 1, chunkSize, f) != chunkSize);
+        ptr += chunkSize;
+        remaining -= chunkSize;
+    }
+
+    if (f != NULL)
+        fclose(f);
+
+    return (NULL);
+}
+
+int tt_read_file(const char *filename, size_t threadCount)
+{
+    FILE *f = fopen(filename, "rb");
+    tt_file_header_t header;
+
+    if (f == NULL)
+    {
+        perror("Unable to open TT file");
+        return (-1);
+    }
+
+    if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, "VTTF", 4)
+        || header.version != TTFileVersion || header.byteOrder != TTFileByteOrder
+        || header.clusterBytes != sizeof(cluster_t))
+    {
+        fputs("Unable to load TT file: unsupported file format\n", stderr);
+        fclose(f);
+        return (-1);
+    }
+
+    fclose(f);
+
+    if (header.clusterCount != TT.clusterCount)
+    {
+        fprintf(stderr, "Unable to load TT file: table has %" PRIu64 " MB, but Hash is set to %" PRIu64 " MB\n",
+            (uint64_t)(header.clusterCount * sizeof(cluster_t) >> 20),
+            (uint64_t)(TT.clusterCount * sizeof(cluster_t) >> 20));
+        return (-1);
+    }
+
+    // Read the table slices in parallel, each thread with its own file handle.
+
+    tt_read_thread_t *threadList = malloc(sizeof(tt_read_thread_t) * threadCount);
+    bool failed = false;
+
+    if (threadList == NULL)
+    {
+        perror("Unable to load TT file");
+        return (-1);
+    }
+
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        threadList[i].filename = filename;
+        threadList[i].start = TT.clusterCount * i / threadCount;
+        threadList[i].end = TT.clusterCount * (i + 1) / threadCount;
+    }
+
+    for (size_t i = 1; i < threadCount; ++i)
+        if (pthread_create(&threadList[i].thread, NULL, &tt_read_thread, &threadList[i]))
+        {
+            perror("Unable to load TT file");
+            exit(EXIT_FAILURE);
+        }
+
+    tt_read_thread(&threadList[0]);
+
+    for (size_t i = 0; i < threadCount; ++i)
+    {
+        if (i)
+            pthread_join(threadList[i].thread, NULL);
+
+        failed |= threadList[i].failed;
+    }
+
+    free(threadList);
+
+    // Don't keep a partially loaded table around.
+
+    if (failed)
+    {
+        fputs("Unable to load TT file: truncated file\n", stderr);
+        tt_bzero(threadCount);
+        return (-1);
+    }
+
+    TT.generation = header.generation;
+    TT.epoch = header.epoch;
+    return (0);
+}
+
+int tt_table_alloc(transposition_t *tt, size_t mbsize)
+{
+    tt->clusterCount = mbsize * 1024 * 1024 / sizeof(cluster_t);
+    tt->table = large_pages_alloc(tt->clusterCount * sizeof(cluster_t), &tt->pageKind);
+    tt->generation = 0;
+    tt->epoch = 0;
+    return (tt->table == NULL ? -1 : 0);
 }
 
-tt_entry_t *tt_probe(hashkey_t key, bool *found)
+void tt_table_discard(transposition_t *tt)
 {
-    tt_entry_t *entry = tt_entry_at(key);
+    if (++tt->epoch == 0)
+        memset(tt->table, 0, tt->clusterCount * sizeof(cluster_t));
+
+    tt->generation += 4;
+}
+
+void tt_table_free(transposition_t *tt)
+{
+    large_pages_free(tt->table, tt->clusterCount * sizeof(cluster_t));
+    tt->table = NULL;
+    tt->clusterCount = 0;
+}
+
+void tt_age_counts(uint64_t counts[TTStatsAges + 1])
+{
+    memset(counts, 0, sizeof(uint64_t) * (TTStatsAges + 1));
+
+    for (size_t i = 0; i < TT.clusterCount; ++i)
+        for (int j = 0; j < ClusterSize; ++j)
+        {
+            tt_data_t data = tt_unpack_data(atomic_load_explicit(&TT.table[i].data[j], memory_order_relaxed));
+            int age = ((259 + TT.generation - data.genbound) & 0xFC) / 4;
+
+            if (!data.depth || tt_cluster_is_stale(&TT, &TT.table[i]))
+                ++counts[0];
+            else
+                ++counts[1 + min(age, TTStatsAges - 1)];
+        }
+}
+
+tt_entry_t tt_probe(transposition_t *tt, tt_stats_t *stats, hashkey_t key, bool *found, tt_data_t *data)
+{
+    cluster_t *cluster = tt_cluster_at(tt, key);
+    tt_data_t clData[ClusterSize];
+
+    tt_stat_add(&stats->probes, 1);
+
+    // Wipe clusters left over from before the last discard, so that their
+    // entries are treated as empty slots from now on.
+
+    if (tt_cluster_is_stale(tt, cluster))
+    {
+        for (int i = 0; i < ClusterSize; ++i)
+        {
+            atomic_store_explicit(&cluster->data[i], 0, memory_order_relaxed);
+            atomic_store_explicit(&cluster->check[i], 0, memory_order_relaxed);
+        }
+
+        atomic_store_explicit(&cluster->epoch, tt->epoch, memory_order_relaxed);
+    }
 
     for (int i = 0; i < ClusterSize; ++i)
-        if (!entry[i].key || entry[i].key == key)
+    {
+        bool keyMatch = tt_load_entry(cluster, i, key, clData + i);
+
+        if (!clData[i].depth || keyMatch)
         {
-            entry[i].genbound = (uint8_t)(TT.generation | (entry[i].genbound & 0x3));
-            *found = (bool)entry[i].key;
-            return (entry + i);
+            *found = (bool)clData[i].depth;
+            *data = clData[i];
+
+            // Refresh the generation of the entry on hits.
+
+            if (*found && (data->genbound & 0xFC) != tt->generation)
+            {
+                data->genbound = (uint8_t)(tt->generation | (data->genbound & 0x3));
+                tt_store_entry(cluster, i, key, *data);
+                tt_stat_add(&stats->fills, 1);
+            }
+
+            data->depth -= TT_DEPTH_OFFSET;
+
+            if (*found)
+            {
+                tt_stat_add(&stats->hits, 1);
+                tt_stat_add(&stats->hitDepths[min(data->depth, TTStatsDepths - 1)], 1);
+            }
+
+            return ((tt_entry_t){cluster, i});
         }
+    }
 
-    tt_entry_t *replace = entry;
+    int replace = 0;
 
     for (int i = 1; i < ClusterSize; ++i)
-        if (replace->depth - ((259 + TT.generation - replace->genbound) & 0xFC)
-            > entry[i].depth - ((259 + TT.generation - entry[i].genbound) & 0xFC))
-            replace = entry + i;
+        if (clData[replace].depth - ((259 + tt->generation - clData[replace].genbound) & 0xFC)
+            > clData[i].depth - ((259 + tt->generation - clData[i].genbound) & 0xFC))
+            replace = i;
 
     *found = false;
-    return (replace);
+    *data = (tt_data_t){NO_SCORE, NO_SCORE, 0, 0, NO_MOVE};
+    return ((tt_entry_t){cluster, replace});
 }
 
-void tt_save(tt_entry_t *entry, hashkey_t k, score_t s, score_t e, int d, int b, move_t m)
+void tt_save(transposition_t *tt, tt_stats_t *stats, tt_entry_t entry, hashkey_t k, score_t s, score_t e, int d, int b, move_t m)
 {
-    if (m || k != entry->key)
-        entry->bestmove = (uint16_t)m;
+    tt_data_t data;
+    bool sameKey = tt_load_entry(entry.cluster, entry.index, k, &data) && data.depth;
+    tt_save_reason_t reason;
+
+    if (!sameKey)
+        reason = !data.depth ? TT_SAVE_EMPTY
+            : (data.genbound & 0xFC) != tt->generation ? TT_SAVE_STALE : TT_SAVE_EVICT;
+    else
+        reason = TT_SAVE_KEEP;
+
+    if (m || !sameKey)
+        data.bestmove = (uint16_t)m;
 
     // Do not erase entries with higher depth for same position.
 
-    if (b == EXACT_BOUND || k != entry->key || d + 4 >= entry->depth)
+    if (b == EXACT_BOUND || !sameKey || d + 4 + TT_DEPTH_OFFSET >= data.depth)
     {
-        entry->key = k;
-        entry->score = s;
-        entry->eval = e;
-        entry->genbound = TT.generation | (uint8_t)b;
-        entry->depth = d;
+        data.score = s;
+        data.eval = e;
+        data.genbound = tt->generation | (uint8_t)b;
+        data.depth = d + TT_DEPTH_OFFSET;
+
+        if (sameKey)
+            reason = TT_SAVE_UPDATE;
     }
+
+    tt_stat_add(&stats->saves[reason], 1);
+    tt_stat_add(&stats->fills, reason == TT_SAVE_EMPTY || reason == TT_SAVE_STALE);
+
+    tt_store_entry(entry.cluster, entry.index, k, data);
 }
@@ -19,6 +19,7 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,18 +35,47 @@
 
 const cmdlink_t commands[] =
 {
-    {"bench", &uci_bench},
-    {"d", &uci_d},
-    {"go", &uci_go},
-    {"isready", &uci_isready},
-    {"ponderhit", &uci_ponderhit},
-    {"position", &uci_position},
-    {"quit", &uci_quit},
-    {"setoption", &uci_setoption},
-    {"stop", &uci_stop},
-    {"uci", &uci_uci},
-    {"ucinewgame", &uci_ucinewgame},
-    {NULL, NULL}
+    {"bench", &uci_bench, CMD_IDLE},
+    {"d", &uci_d, CMD_IDLE},
+    {"dedup", &uci_dedup, CMD_IDLE},
+    {"go", &uci_go, CMD_IDLE},
+    {"isready", &uci_isready, CMD_QUEUED},
+    {"pack", &uci_pack, CMD_IDLE},
+    {"ponderhit", &uci_ponderhit, CMD_FLAG},
+    {"position", &uci_position, CMD_QUEUED},
+    {"quit", &uci_quit, CMD_FLAG},
+    {"rescore", &uci_rescore, CMD_IDLE},
+    {"setoption", &uci_setoption, CMD_IDLE},
+    {"stop", &uci_stop, CMD_FLAG},
+    {"tt", &uci_tt, CMD_IDLE},
+    {"uci", &uci_uci, CMD_QUEUED},
+    {"ucinewgame", &uci_ucinewgame, CMD_IDLE},
+    {NULL, NULL, CMD_QUEUED}
+};
+
+// Commands read by the input thread are executed in order by the command
+// thread, so that the input thread never waits for a search to end. The
+// queue is a plain linked list of command lines.
+
+typedef struct cmd_node_s
+{
+    char *line;
+    struct cmd_node_s *next;
+}
+cmd_node_t;
+
+typedef struct cmd_queue_s
+{
+    cmd_node_t *head;
+    cmd_node_t **tail;
+    bool closed;
+    pthread_mutex_t mutex;
+    pthread_cond_t condVar;
+}
+cmd_queue_t;
+
+static cmd_queue_t CmdQueue = {
+    NULL, &CmdQueue.head, false, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER
 };
 
 const char *BoundStr[] = {
@@ -159,7 +189,7 @@ void print_pv(const board_t *board, root_move_t *rootMove, int multiPv, int dept
     printf("info depth %d seldepth %d multipv %d score %s%s", max(depth + searchedMove, 1),
         rootMove->seldepth, multiPv, score_to_str(rootScore), BoundStr[bound]);
     printf(" nodes %" FMT_INFO " nps %" FMT_INFO " hashfull %d time %" FMT_INFO " pv",
-        (info_t)nodes, (info_t)nps, tt_hashfull(), (info_t)time);
+        (info_t)nodes, (info_t)nps, wpool_hashfull(&WPool), (info_t)time);
 
     for (size_t k = 0; rootMove->pv[k]; ++k)
         printf(" %s", move_to_str(rootMove->pv[k], board->chess960));
@@ -172,19 +202,73 @@ void uci_isready(const char *args __attribute__((unused)))
     fflush(stdout);
 }
 
+static void cmd_queue_push(cmd_queue_t *queue, const char *line)
+{
+    cmd_node_t *node = malloc(sizeof(cmd_node_t));
+
+    if (node == NULL || (node->line = strdup(line)) == NULL)
+    {
+        perror("Unable to queue command");
+        exit(EXIT_FAILURE);
+    }
+
+    node->next = NULL;
+    pthread_mutex_lock(&queue->mutex);
+    *queue->tail = node;
+    queue->tail = &node->next;
+    pthread_cond_signal(&queue->condVar);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// Returns the next command line, which must be freed by the caller. Returns
+// NULL once the queue is closed and empty.
+static char *cmd_queue_pop(cmd_queue_t *queue)
+{
+    char *line = NULL;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    while (queue->head == NULL && !queue->closed)
+        pthread_cond_wait(&queue->condVar, &queue->mutex);
+
+    if (queue->head != NULL)
+    {
+        cmd_node_t *node = queue->head;
+
+        line = node->line;
+        queue->head = node->next;
+
+        if (queue->head == NULL)
+            queue->tail = &queue->head;
+
+        free(node);
+    }
+
+    pthread_mutex_unlock(&queue->mutex);
+    return (line);
+}
+
+static void cmd_queue_close(cmd_queue_t *queue)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->closed = true;
+    pthread_cond_signal(&queue->condVar);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
 void uci_quit(const char *args __attribute__((unused)))
 {
-    WPool.stop = true;
+    wpool_stop(&WPool);
 }
 
 void uci_stop(const char *args __attribute__((unused)))
 {
-    WPool.stop = true;
+    wpool_stop(&WPool);
 }
 
 void uci_ponderhit(const char *args __attribute__((unused)))
 {
-    WPool.ponder = false;
+    wpool_ponderhit(&WPool);
 }
 
 void uci_uci(const char *args __attribute__((unused)))
@@ -200,10 +284,132 @@ void uci_ucinewgame(const char *args)
 {
     (void)args;
     worker_wait_search_end(wpool_main_worker(&WPool));
-    tt_bzero((size_t)Options.threads);
+    tt_discard();
     wpool_reset(&WPool);
 }
 
+static void print_percent(const char *name, uint64_t count, uint64_t total)
+{
+    printf("info string %-16s %12" PRIu64 " (%5.1f%%)\n", name, count, count * 100.0 / (total + !total));
+}
+
+// Prints the TT counters summed over all workers, along with the occupancy of
+// the table for each generation age.
+
+static void tt_print_stats(void)
+{
+    static const char *SaveReasons[TT_SAVE_NB] = {
+        "Empty slot", "Older search", "Current search", "Updated", "Kept deeper"
+    };
+    tt_stats_t stats;
+    uint64_t ageCounts[TTStatsAges + 1];
+    uint64_t saveCount = 0;
+    char name[32];
+
+    wpool_get_tt_stats(&WPool, &stats);
+    tt_age_counts(ageCounts);
+
+    uint64_t probes = tt_stat(&stats.probes);
+    uint64_t hits = tt_stat(&stats.hits);
+
+    printf("info string Probes %" PRIu64 ", hits %" PRIu64 " (%.1f%%), collisions %" PRIu64 "\n",
+        probes, hits, hits * 100.0 / (probes + !probes), tt_stat(&stats.collisions));
+
+    puts("info string Hits by entry depth:");
+
+    for (int d = 0; d < TTStatsDepths; ++d)
+        if (tt_stat(&stats.hitDepths[d]))
+        {
+            sprintf(name, d == TTStatsDepths - 1 ? "depth %d+" : "depth %d", d);
+            print_percent(name, tt_stat(&stats.hitDepths[d]), hits);
+        }
+
+    for (int r = 0; r < TT_SAVE_NB; ++r)
+        saveCount += tt_stat(&stats.saves[r]);
+
+    puts("info string Saves by replaced slot:");
+
+    for (int r = 0; r < TT_SAVE_NB; ++r)
+        print_percent(SaveReasons[r], tt_stat(&stats.saves[r]), saveCount);
+
+    puts("info string Entries by generation age:");
+    print_percent("empty", ageCounts[0], TT.clusterCount * ClusterSize);
+
+    for (int a = 0; a < TTStatsAges; ++a)
+    {
+        sprintf(name, a == TTStatsAges - 1 ? "age %d+" : "age %d", a);
+        print_percent(name, ageCounts[a + 1], TT.clusterCount * ClusterSize);
+    }
+
+    uint64_t evalProbes = 0;
+    uint64_t evalHits = 0;
+
+    for (size_t i = 0; i < WPool.size; ++i)
+    {
+        evalProbes += WPool.workerList[i]->evalCache.probes;
+        evalHits += WPool.workerList[i]->evalCache.hits;
+    }
+
+    printf("info string Eval cache probes %" PRIu64 ", hits %" PRIu64 " (%.1f%%)\n",
+        evalProbes, evalHits, evalHits * 100.0 / (evalProbes + !evalProbes));
+}
+
+// Saves or loads the TT, so that analysis sessions can be resumed later, or
+// shows statistics about its usage.
+
+void uci_tt(const char *args)
+{
+    char *copy = strdup(args ? args : "");
+    char *subcommand = strtok(copy, Delimiters);
+    char *filename = strtok(NULL, Delimiters);
+
+    if (subcommand != NULL && !strcmp(subcommand, "stats"))
+    {
+        worker_wait_search_end(wpool_main_worker(&WPool));
+        tt_print_stats();
+        fflush(stdout);
+        free(copy);
+        return ;
+    }
+
+    if (filename == NULL || (strcmp(subcommand, "save") && strcmp(subcommand, "load")))
+    {
+        puts("info string Usage: tt save <file> | tt load <file> | tt stats");
+        fflush(stdout);
+        free(copy);
+        return ;
+    }
+
+    worker_wait_search_end(wpool_main_worker(&WPool));
+
+    if (!strcmp(subcommand, "save"))
+    {
+        if (tt_write_file(filename))
+            printf("info string Unable to save TT to %s\n", filename);
+        else
+            printf("info string Saved TT to %s\n", filename);
+    }
+    else
+    {
+        uint64_t ageCounts[TTStatsAges + 1];
+
+        if (tt_read_file(filename, (size_t)Options.threads))
+            printf("info string Unable to load TT from %s\n", filename);
+        else
+        {
+            // Count the loaded entries of the saved generation as claimed, so
+            // that hashfull reflects the table contents until the next search.
+
+            tt_age_counts(ageCounts);
+            wpool_set_tt_fills(&WPool, ageCounts[1]);
+            printf("info string Loaded TT from %s, hashfull %d\n", filename, wpool_hashfull(&WPool));
+        }
+    }
+
+    fflush(stdout);
+    free(copy);
+}
+
 // Pretty prints the board, along with the hash key and the eval.
 
 void uci_d(const char *args __attribute__((unused)))
@@ -224,7 +430,14 @@ void uci_d(const char *args __attribute__((unused)))
 
     printf("\nFEN: %s\nKey: 0x%" KEY_INFO "\n", board_fen(&Board), (info_t)Board.stack->boardKey);
 
-    double eval = (double)evaluate(&Board) / 100.0;
+    // Borrow the caches of the main worker for the eval. This command only
+    // runs once the search is over.
+
+    board_t evalBoard = Board;
+
+    evalBoard.worker = wpool_main_worker(&WPool);
+
+    double eval = (double)evaluate(&evalBoard) / 100.0;
 
     printf("Eval (from %s's POV): %+.2lf\n\n", Board.sideToMove == WHITE ? "White" : "Black", eval);
     fflush(stdout);
@@ -235,6 +448,9 @@ void uci_position(const char *args)
     static boardstack_t **hiddenList = NULL;
     static size_t hiddenSize = 0;
 
+    if (args == NULL)
+        return ;
+
     if (hiddenSize > 0)
     {
         for (size_t i = 0; i < hiddenSize; ++i)
@@ -276,8 +492,12 @@ void uci_position(const char *args)
     else
         return ;
 
+    // The UCI board is never attached to a worker, so that the moves played
+    // here don't touch the counters of the main worker, which might be
+    // searching.
+
     set_board(&Board, fen, Options.chess960, *hiddenList);
-    Board.worker = wpool_main_worker(&WPool);
+    Board.worker = NULL;
     free(fen);
     token = get_next_token(&ptr);
 
@@ -297,10 +517,11 @@ void uci_position(const char *args)
 
 void uci_go(const char *args)
 {
-    worker_wait_search_end(wpool_main_worker(&WPool));
+    goparams_t params;
+    movelist_t searchMoves;
 
-    memset(&SearchParams, 0, sizeof(goparams_t));
-    list_all(&SearchMoves, &Board);
+    memset(&params, 0, sizeof(goparams_t));
+    list_all(&searchMoves, &Board);
 
     char *copy = strdup(args ? args : "");
     char *token = strtok(copy, Delimiters);
@@ -311,86 +532,92 @@ void uci_go(const char *args)
         {
             token = strtok(NULL, Delimiters);
 
-            extmove_t *m = SearchMoves.moves;
+            extmove_t *m = searchMoves.moves;
 
             while (token)
             {
                 (m++)->move = str_to_move(&Board, token);
                 token = strtok(NULL, Delimiters);
             }
-            SearchMoves.last = m;
+            searchMoves.last = m;
             break ;
         }
         else if (strcmp(token, "wtime") == 0)
         {
             token = strtok(NULL, Delimiters);
             if (token)
-                SearchParams.wtime = (clock_t)atoll(token);
+                params.wtime = (clock_t)atoll(token);
         }
         else if (strcmp(token, "btime") == 0)
         {
             token = strtok(NULL, Delimiters);
             if (token)
-                SearchParams.btime = (clock_t)atoll(token);
+                params.btime = (clock_t)atoll(token);
         }
         else if (strcmp(token, "winc") == 0)
         {
             token = strtok(NULL, Delimiters);
             if (token)
-                SearchParams.winc = (clock_t)atoll(token);
+                params.winc = (clock_t)atoll(token);
         }
         else if (strcmp(token, "binc") == 0)
         {
             token = strtok(NULL, Delimiters);
             if (token)
-                SearchParams.binc = (clock_t)atoll(token);
+                params.binc = (clock_t)atoll(token);
         }
         else if (strcmp(token, "movestogo") == 0)
         {
             token = strtok(NULL, Delimiters);
             if (token)
-                SearchParams.movestogo = atoi(token);
+                params.movestogo = atoi(token);
         }
         else if (strcmp(token, "depth") == 0)
         {
             token = strtok(NULL, Delimiters);
             if (token)
-                SearchParams.depth = atoi(token);
+                params.depth = atoi(token);
         }
         else if (strcmp(token, "nodes") == 0)
         {
             token = strtok(NULL, Delimiters);
             if (token)
-                SearchParams.nodes = (size_t)atoll(token);
+                params.nodes = (size_t)atoll(token);
         }
         else if (strcmp(token, "mate") == 0)
         {
             token = strtok(NULL, Delimiters);
             if (token)
-                SearchParams.mate = atoi(token);
+                params.mate = atoi(token);
         }
         else if (strcmp(token, "perft") == 0)
         {
             token = strtok(NULL, Delimiters);
             if (token)
-                SearchParams.perft = atoi(token);
+                params.perft = atoi(token);
+        }
+        else if (strcmp(token, "hash") == 0)
+        {
+            token = strtok(NULL, Delimiters);
+            if (token)
+                params.perftHash = atoi(token);
         }
         else if (strcmp(token, "movetime") == 0)
         {
             token = strtok(NULL, Delimiters);
             if (token)
-                SearchParams.movetime = (clock_t)atoll(token);
+                params.movetime = (clock_t)atoll(token);
         }
         else if (strcmp(token, "infinite") == 0)
-            SearchParams.infinite = 1;
+            params.infinite = 1;
 
         else if (strcmp(token, "ponder") == 0)
-            SearchParams.ponder = 1;
+            params.ponder = 1;
 
         token = strtok(NULL, Delimiters);
     }
 
-    wpool_start_search(&WPool, &Board, &SearchParams);
+    wpool_start_search(&WPool, &Board, &params, &searchMoves);
     free(copy);
 }
 
@@ -441,50 +668,113 @@ void uci_setoption(const char *args)
     free(copy);
 }
 
-int execute_uci_cmd(const char *command)
+static const cmdlink_t *find_uci_cmd(const char *name)
+{
+    for (size_t i = 0; commands[i].commandName != NULL; ++i)
+        if (strcmp(commands[i].commandName, name) == 0)
+            return (&commands[i]);
+
+    return (NULL);
+}
+
+// Runs a command taken from the queue, on the command thread. The command is
+// split with the same tokenizer as in execute_uci_cmd(), so that both always
+// agree on the command name.
+
+static void run_queued_cmd(const char *command)
 {
     char *dup = strdup(command);
-    char *cmd = strtok(dup, Delimiters);
+    char *ptr = dup;
+    char *cmd = get_next_token(&ptr);
+    const cmdlink_t *link = (cmd != NULL) ? find_uci_cmd(cmd) : NULL;
+
+    // Commands get NULL arguments when there is nothing after their name.
+
+    while (isspace(*ptr))
+        ++ptr;
 
-    if (!cmd)
+    if (link != NULL)
     {
-        free(dup);
-        return (1);
+        if (link->kind == CMD_IDLE)
+            worker_wait_search_end(wpool_main_worker(&WPool));
+
+        link->call(*ptr != '\0' ? ptr : NULL);
     }
 
-    for (size_t i = 0; commands[i].commandName != NULL; ++i)
+    free(dup);
+}
+
+static void *cmd_thread_entry(void *nothing __attribute__((unused)))
+{
+    char *line;
+
+    while ((line = cmd_queue_pop(&CmdQueue)) != NULL)
     {
-        if (strcmp(commands[i].commandName, cmd) == 0)
-        {
-            commands[i].call(strtok(NULL, ""));
-            break ;
-        }
+        run_queued_cmd(line);
+        free(line);
     }
 
-    if (strcmp(cmd, "quit") == 0)
+    return (NULL);
+}
+
+// Dispatches a command read by the input thread. Flag commands are executed
+// right away, so that they reach the running search even if the command
+// thread is waiting for it to end, and are also queued, so that they reach
+// a search whose "go" is still in the queue. Returns zero on "quit", which
+// ends the input: the commands queued before it still run to completion.
+// strtok() is reserved to the command thread, since its state is shared by
+// all threads.
+
+int execute_uci_cmd(const char *command)
+{
+    char *dup = strdup(command);
+    char *ptr = dup;
+    char *cmd = get_next_token(&ptr);
+    const cmdlink_t *link = (cmd != NULL) ? find_uci_cmd(cmd) : NULL;
+
+    if (link == NULL)
     {
         free(dup);
-        return (0);
+        return (1);
     }
 
+    if (link->kind == CMD_FLAG)
+        link->call(ptr);
+
+    cmd_queue_push(&CmdQueue, command);
+
+    int ret = strcmp(cmd, "quit") != 0;
+
     free(dup);
-    return (1);
+    return (ret);
 }
 
 void on_hash_set(void *data)
 {
     tt_resize((size_t)*(long *)data);
     printf("info string set Hash to %lu MB\n", *(long *)data);
+    printf("info string Hash allocated with %s\n", page_kind_name(TT.pageKind));
     fflush(stdout);
 }
 
 void on_clear_hash(void *nothing __attribute__((unused)))
 {
-    tt_bzero((size_t)Options.threads);
+    tt_discard();
     puts("info string cleared hash");
     fflush(stdout);
 }
 
+void on_eval_cache_set(void *data)
+{
+    worker_wait_search_end(wpool_main_worker(&WPool));
+
+    for (size_t i = 0; i < WPool.size; ++i)
+        eval_cache_resize(&WPool.workerList[i]->evalCache, (size_t)*(long *)data);
+
+    printf("info string set EvalCache to %lu MB per thread\n", *(long *)data);
+    fflush(stdout);
+}
+
 void on_thread_set(void *data)
 {
     wpool_init(&WPool, (unsigned long)*(long *)data);
@@ -580,6 +870,11 @@ void on_network_set(void *data)
             }
         }
     }
+
+    // Evals cached with the previous network are no longer valid.
+
+    for (size_t i = 0; i < WPool.size; ++i)
+        eval_cache_clear(&WPool.workerList[i]->evalCache);
 }
 
 void uci_loop(int argc, char **argv)
@@ -592,16 +887,29 @@ void uci_loop(int argc, char **argv)
     add_option_spin_int(&OptionList, "Hash", &Options.hash, 1, MAX_HASH, &on_hash_set);
     add_option_spin_int(&OptionList, "Move Overhead", &Options.moveOverhead, 0, 30000, NULL);
     add_option_spin_int(&OptionList, "MultiPV", &Options.multiPv, 1, 500, NULL);
+    add_option_spin_int(&OptionList, "EvalCache", &Options.evalCache, 0, 1024, &on_eval_cache_set);
     add_option_string(&OptionList, "EvalFile", &Options.networkFile, &on_network_set);
     add_option_check(&OptionList, "UCI_Chess960", &Options.chess960, NULL);
     add_option_check(&OptionList, "Ponder", &Options.ponder, NULL);
+    add_option_check(&OptionList, "ABDADA", &Options.abdada, NULL);
     add_option_button(&OptionList, "Clear Hash", &on_clear_hash);
 
     uci_position("startpos");
 
+    pthread_t cmdThread;
+
+    if (pthread_create(&cmdThread, &WorkerSettings, &cmd_thread_entry, NULL))
+    {
+        perror("Unable to create command thread");
+        exit(EXIT_FAILURE);
+    }
+
     if (argc > 1)
+    {
         for (int i = 1; i < argc; ++i)
-            execute_uci_cmd(argv[i]);
+            if (execute_uci_cmd(argv[i]) == 0)
+                break ;
+    }
     else
     {
         char *line = malloc(16384);
@@ -613,6 +921,11 @@ void uci_loop(int argc, char **argv)
         free(line);
     }
 
+    // Let the remaining commands run to completion, and stop the search that
+    // might have been started by the last of them.
+
+    cmd_queue_close(&CmdQueue);
+    pthread_join(cmdThread, NULL);
     uci_quit(NULL);
     quit_option_list(&OptionList);
 }
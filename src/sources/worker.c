@@ -1,10 +1,16 @@
 #include <stdio.h>
 #include <string.h>
+#include "large_pages.h"
 #include "movelist.h"
+#include "numa.h"
+#include "perft.h"
 #include "uci.h"
 #include "worker.h"
 
-worker_pool_t WPool;
+worker_pool_t WPool = {
+    .waitMutex = PTHREAD_MUTEX_INITIALIZER,
+    .waitCondVar = PTHREAD_COND_INITIALIZER
+};
 
 INLINED int rtm_greater_than(root_move_t *right, root_move_t *left)
 {
@@ -48,8 +54,18 @@ root_move_t *find_root_move(root_move_t *begin, root_move_t *end, move_t move)
 void worker_init(worker_t *worker, size_t idx)
 {
     worker->idx = idx;
-    worker->stack = NULL;
-    worker->pawnTable = calloc(PawnTableSize, sizeof(pawn_entry_t));
+    worker->board.acc = NULL;
+    worker->accSize = 0;
+    worker->rootMoves = malloc(sizeof(root_move_t) * MaxRootMoves);
+    worker->rootPvs = malloc(sizeof(move_t) * MaxRootMoves * RootPvSize);
+    worker->pawnTable = large_pages_alloc(PawnTableSize * sizeof(pawn_entry_t), NULL);
+    memset(&worker->ttStats, 0, sizeof(tt_stats_t));
+    worker->evalCache.table = NULL;
+    eval_cache_resize(&worker->evalCache, (size_t)Options.evalCache);
+    worker->qsCache.table = NULL;
+    qsearch_cache_init(&worker->qsCache);
+    worker->tt = &TT;
+    worker->nodeLimit = UINT64_MAX;
     worker->exit = false;
     worker->searching = true;
 
@@ -59,6 +75,15 @@ void worker_init(worker_t *worker, size_t idx)
         exit(EXIT_FAILURE);
     }
 
+    if (worker->rootMoves == NULL || worker->rootPvs == NULL)
+    {
+        perror("Unable to allocate root moves");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t k = 0; k < MaxRootMoves; ++k)
+        worker->rootMoves[k].pv = worker->rootPvs + k * RootPvSize;
+
     if (pthread_mutex_init(&worker->mutex, NULL)
         || pthread_cond_init(&worker->condVar, NULL))
     {
@@ -84,7 +109,12 @@ void worker_destroy(worker_t *worker)
         exit(EXIT_FAILURE);
     }
 
-    free(worker->pawnTable);
+    large_pages_free(worker->pawnTable, PawnTableSize * sizeof(pawn_entry_t));
+    eval_cache_resize(&worker->evalCache, 0);
+    qsearch_cache_free(&worker->qsCache);
+    free(worker->board.acc);
+    free(worker->rootMoves);
+    free(worker->rootPvs);
     pthread_mutex_destroy(&worker->mutex);
     pthread_cond_destroy(&worker->condVar);
 }
@@ -95,9 +125,19 @@ void worker_reset(worker_t *worker)
     memset(worker->ctHistory, 0, sizeof(continuation_history_t));
     memset(worker->cmHistory, 0, sizeof(countermove_history_t));
     memset(worker->capHistory, 0, sizeof(capture_history_t));
+    memset(&worker->ttStats, 0, sizeof(tt_stats_t));
+    eval_cache_clear(&worker->evalCache);
+    qsearch_cache_clear(&worker->qsCache);
     worker->verifPlies = 0;
 }
 
+void worker_age_histories(worker_t *worker)
+{
+    age_history(&worker->bfHistory[0][0], sizeof(butterfly_history_t) / sizeof(int16_t));
+    age_history(&worker->capHistory[0][0][0], sizeof(capture_history_t) / sizeof(int16_t));
+    age_history(&worker->ctHistory[0][0][0][0], sizeof(continuation_history_t) / sizeof(int16_t));
+}
+
 void worker_start_search(worker_t *worker)
 {
     pthread_mutex_lock(&worker->mutex);
@@ -114,10 +154,56 @@ void worker_wait_search_end(worker_t *worker)
     pthread_mutex_unlock(&worker->mutex);
 }
 
+// Copies the root position and root moves of the pool to the worker. Each
+// worker does this from its own thread when the search starts, reusing the
+// buffers of its previous searches.
+
+static void worker_setup_search(worker_t *worker, const worker_pool_t *wpool)
+{
+    extern Network NN;
+    const size_t accSize = NN.layerSizes[1] * 2;
+    weight_t *acc = worker->board.acc;
+
+    if (worker->accSize != accSize)
+    {
+        acc = realloc(acc, sizeof(weight_t) * accSize);
+
+        if (acc == NULL)
+        {
+            perror("Unable to allocate board accumulator");
+            exit(EXIT_FAILURE);
+        }
+
+        worker->accSize = accSize;
+    }
+
+    worker->board = wpool->rootBoard;
+    worker->board.acc = acc;
+    worker->board.worker = worker;
+    memcpy(acc, wpool->rootBoard.acc, sizeof(weight_t) * accSize);
+
+    worker->rootCount = movelist_size(&SearchMoves);
+
+    for (size_t k = 0; k < worker->rootCount; ++k)
+    {
+        root_move_t *curRootMove = &worker->rootMoves[k];
+
+        curRootMove->move = SearchMoves.moves[k].move;
+        curRootMove->seldepth = 0;
+        curRootMove->score = curRootMove->prevScore = -INF_SCORE;
+        curRootMove->pv[0] = curRootMove->pv[1] = NO_MOVE;
+    }
+}
+
 void *worker_entry(void *ptr)
 {
     worker_t *worker = ptr;
 
+    // Spread the workers over all NUMA nodes. Everything the worker allocates
+    // lazily (like its pawn table pages) is then first touched from its node.
+
+    numa_bind_thread(worker->idx);
+
     while (true)
     {
         pthread_mutex_lock(&worker->mutex);
@@ -131,11 +217,17 @@ void *worker_entry(void *ptr)
             break ;
 
         pthread_mutex_unlock(&worker->mutex);
+        worker_setup_search(worker, &WPool);
 
-        if (worker->idx)
+        if (SearchParams.perft)
+            worker_perft(worker);
+        else if (worker->idx)
             worker_search(worker);
         else
             main_worker_search(worker);
+
+        if (worker->idx == 0)
+            WPool.state = ENGINE_IDLE;
     }
 
     return (NULL);
@@ -154,7 +246,7 @@ void wpool_init(worker_pool_t *wpool, size_t threads)
             worker_t *curWorker = wpool->workerList[wpool->size];
 
             worker_destroy(curWorker);
-            free(curWorker);
+            aligned_free(curWorker);
         }
 
         free(wpool->workerList);
@@ -172,7 +264,7 @@ void wpool_init(worker_pool_t *wpool, size_t threads)
 
         while (wpool->size < threads)
         {
-            wpool->workerList[wpool->size] = malloc(sizeof(worker_t));
+            wpool->workerList[wpool->size] = aligned_malloc(_Alignof(worker_t), sizeof(worker_t));
 
             if (wpool->workerList[wpool->size] == NULL)
             {
@@ -186,6 +278,14 @@ void wpool_init(worker_pool_t *wpool, size_t threads)
 
         wpool_reset(wpool);
     }
+    else
+    {
+        free(wpool->rootStacks);
+        free(wpool->rootBoard.acc);
+        wpool->rootStacks = NULL;
+        wpool->rootBoard.acc = NULL;
+        wpool->rootStackCapacity = wpool->rootAccSize = 0;
+    }
 }
 
 void wpool_reset(worker_pool_t *wpool)
@@ -196,54 +296,98 @@ void wpool_reset(worker_pool_t *wpool)
     wpool->checks = 1000;
 }
 
-void wpool_start_search(worker_pool_t *wpool, const board_t *rootBoard,
-    const goparams_t *searchParams)
-{
-    worker_wait_search_end(wpool_main_worker(wpool));
+// Copies the root board to the pool, along with the stack entries which can be
+// reached when looking for repetitions, and the accumulator.
 
-    wpool->stop = false;
-    wpool->ponder = searchParams->ponder;
+static void wpool_snapshot_root(worker_pool_t *wpool, const board_t *rootBoard)
+{
+    extern Network NN;
+    const size_t accSize = NN.layerSizes[1] * 2;
+    weight_t *acc = wpool->rootBoard.acc;
+    size_t stackCount = (size_t)min(rootBoard->stack->rule50, rootBoard->stack->pliesFromNullMove) + 1;
 
-    for (size_t i = 0; i < wpool->size; ++i)
+    if (wpool->rootAccSize != accSize)
     {
-        worker_t *curWorker = wpool->workerList[i];
-        extern Network NN;
+        acc = realloc(acc, sizeof(weight_t) * accSize);
 
-        curWorker->nodes = 0;
-        curWorker->board = *rootBoard;
-        curWorker->stack = curWorker->board.stack = dup_boardstack(rootBoard->stack);
-
-        curWorker->board.acc = malloc(sizeof(weight_t) * NN.layerSizes[1] * 2);
-
-        if (curWorker->board.acc == NULL)
+        if (acc == NULL)
         {
             perror("Unable to allocate board accumulator");
             exit(EXIT_FAILURE);
         }
 
-        memcpy(curWorker->board.acc, rootBoard->acc, sizeof(weight_t) * NN.layerSizes[1] * 2);
+        wpool->rootAccSize = accSize;
+    }
 
-        curWorker->board.worker = curWorker;
-        curWorker->rootCount = movelist_size(&SearchMoves);
-        curWorker->rootMoves = malloc(sizeof(root_move_t) * curWorker->rootCount);
+    if (wpool->rootStackCapacity < stackCount)
+    {
+        free(wpool->rootStacks);
+        wpool->rootStacks = malloc(sizeof(boardstack_t) * stackCount);
 
-        if (curWorker->rootMoves == NULL && curWorker->rootCount != 0)
+        if (wpool->rootStacks == NULL)
         {
-            perror("Unable to allocate root moves");
+            perror("Unable to allocate root board stack");
             exit(EXIT_FAILURE);
         }
 
-        for (size_t k = 0; k < curWorker->rootCount; ++k)
-        {
-            root_move_t *curRootMove = &curWorker->rootMoves[k];
+        wpool->rootStackCapacity = stackCount;
+    }
 
-            curRootMove->move = SearchMoves.moves[k].move;
-            curRootMove->seldepth = 0;
-            curRootMove->score = curRootMove->prevScore = -INF_SCORE;
-            curRootMove->pv[0] = curRootMove->pv[1] = NO_MOVE;
-        }
+    wpool->rootBoard = *rootBoard;
+    wpool->rootBoard.acc = acc;
+    memcpy(acc, rootBoard->acc, sizeof(weight_t) * accSize);
+
+    // Copy the stack entries from the newest to the oldest, and link them
+    // together.
+
+    const boardstack_t *stack = rootBoard->stack;
+    boardstack_t *prev = NULL;
+    size_t i = stackCount;
+
+    while (i > 0 && stack != NULL)
+    {
+        boardstack_t *copy = &wpool->rootStacks[--i];
+
+        *copy = *stack;
+
+        if (prev != NULL)
+            prev->prev = copy;
+        else
+            wpool->rootBoard.stack = copy;
+
+        prev = copy;
+        stack = stack->prev;
     }
 
+    prev->prev = NULL;
+}
+
+void wpool_start_search(worker_pool_t *wpool, const board_t *rootBoard,
+    const goparams_t *searchParams, const movelist_t *searchMoves)
+{
+    worker_wait_search_end(wpool_main_worker(wpool));
+
+    wpool_snapshot_root(wpool, rootBoard);
+    SearchParams = *searchParams;
+    SearchMoves = *searchMoves;
+    SearchMoves.last = SearchMoves.moves + movelist_size(searchMoves);
+    wpool->stop = false;
+    wpool->ponder = searchParams->ponder;
+    wpool->state = searchParams->ponder ? ENGINE_PONDERING : ENGINE_SEARCHING;
+
+    // Counters are reset here rather than by the workers themselves, since
+    // the main worker starts reporting them before all helpers are set up.
+
+    for (size_t i = 0; i < wpool->size; ++i)
+    {
+        worker_t *curWorker = wpool->workerList[i];
+
+        worker_set_nodes(curWorker, 0);
+        curWorker->completedDepth = 0;
+    }
+
+    wpool_set_tt_fills(wpool, 0);
+
     worker_start_search(wpool_main_worker(wpool));
 }
 
@@ -259,12 +403,83 @@ void wpool_wait_search_end(worker_pool_t *wpool)
         worker_wait_search_end(wpool->workerList[i]);
 }
 
+void wpool_stop(worker_pool_t *wpool)
+{
+    pthread_mutex_lock(&wpool->waitMutex);
+    wpool->stop = true;
+    pthread_cond_signal(&wpool->waitCondVar);
+    pthread_mutex_unlock(&wpool->waitMutex);
+}
+
+void wpool_ponderhit(worker_pool_t *wpool)
+{
+    pthread_mutex_lock(&wpool->waitMutex);
+
+    if (wpool->state == ENGINE_PONDERING)
+    {
+        wpool->ponder = false;
+        wpool->state = ENGINE_SEARCHING;
+    }
+
+    pthread_cond_signal(&wpool->waitCondVar);
+    pthread_mutex_unlock(&wpool->waitMutex);
+}
+
+void wpool_wait_release(worker_pool_t *wpool)
+{
+    pthread_mutex_lock(&wpool->waitMutex);
+    while (!wpool->stop && (wpool->ponder || SearchParams.infinite))
+        pthread_cond_wait(&wpool->waitCondVar, &wpool->waitMutex);
+    pthread_mutex_unlock(&wpool->waitMutex);
+}
+
 uint64_t wpool_get_total_nodes(worker_pool_t *wpool)
 {
     uint64_t totalNodes = 0;
 
     for (size_t i = 0; i < wpool->size; ++i)
-        totalNodes += wpool->workerList[i]->nodes;
+        totalNodes += worker_nodes(wpool->workerList[i]);
 
     return (totalNodes);
 }
+
+void wpool_get_tt_stats(worker_pool_t *wpool, tt_stats_t *stats)
+{
+    memset(stats, 0, sizeof(tt_stats_t));
+
+    for (size_t i = 0; i < wpool->size; ++i)
+    {
+        const tt_stats_t *cur = &wpool->workerList[i]->ttStats;
+
+        tt_stat_add(&stats->probes, tt_stat(&cur->probes));
+        tt_stat_add(&stats->hits, tt_stat(&cur->hits));
+        tt_stat_add(&stats->collisions, tt_stat(&cur->collisions));
+        tt_stat_add(&stats->fills, tt_stat(&cur->fills));
+
+        for (int d = 0; d < TTStatsDepths; ++d)
+            tt_stat_add(&stats->hitDepths[d], tt_stat(&cur->hitDepths[d]));
+
+        for (int r = 0; r < TT_SAVE_NB; ++r)
+            tt_stat_add(&stats->saves[r], tt_stat(&cur->saves[r]));
+    }
+}
+
+void wpool_set_tt_fills(worker_pool_t *wpool, uint64_t fills)
+{
+    for (size_t i = 0; i < wpool->size; ++i)
+        tt_stat_set(&wpool->workerList[i]->ttStats.fills, i == 0 ? fills : 0);
+}
+
+int wpool_hashfull(worker_pool_t *wpool)
+{
+    uint64_t fills = 0;
+
+    // The fill counters might slightly overestimate the table usage when
+    // workers race on the same entries, so cap the result.
+
+    for (size_t i = 0; i < wpool->size; ++i)
+        fills += tt_stat(&wpool->workerList[i]->ttStats.fills);
+
+    fills = fills * 1000 / (TT.clusterCount * ClusterSize);
+    return (fills > 1000 ? 1000 : (int)fills);
+}